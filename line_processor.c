@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -6,289 +7,1441 @@
 #include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
-- A program with a pipeline of 4 threads that interact with each other as producers and consumers.
+- A program with a pipeline of threads that interact with each other as producers and consumers.
 - Input thread is the first thread in the pipeline. It gets input from the user as a file or standard in and puts it in a buffer it shares with the next thread in the pipeline.
-- Line separator thread is the second thread in the pipeline. It consumes items from the buffer it shares with the input thread. It replaces every line separator in the input by a space.
-- It puts the space in a buffer it shares with the next thread in the pipeline. Thus this thread implements both consumer and producer functionalities.
-- The plus sign thread is the third thread in the pipeline. It consumes items from the buffer it shares with the line separator thread and replaces "++" with a "^".
-- Output thread is the fourth thread in the pipeline. It consumes items from the buffer it shares with the plus sign thread and prints the items as standard out.
-*/
-
-// Size of the buffers
-#define SIZE 1000
-
-// Number of items that will be produced. This number is less than the size of the buffer. Hence, we can model the buffer as being unbounded.
-#define NUM_ITEMS 50
-
-bool stop_processing = false;
-
-// Buffer 1, shared resource between input thread and line separator thread
-char buffer_1[SIZE];
-// Number of items in the buffer
-int count_1 = 0;
-// Index where the input thread will put the next item
-int prod_idx_1 = 0;
-// Index where the square-root thread will pick up the next item
-int con_idx_1 = 0;
-// Initialize the mutex for buffer 1
-pthread_mutex_t mutex_1 = PTHREAD_MUTEX_INITIALIZER;
-// Initialize the condition variable for buffer 1
-pthread_cond_t full_1 = PTHREAD_COND_INITIALIZER;
-
-
-// Buffer 2, shared resource between line separator thread and plus sign thread
-char buffer_2[SIZE];
-// Number of items in the buffer
-int count_2 = 0;
-// Index where the thread will put the next item
-int prod_idx_2 = 0;
-// Index where the output thread will pick up the next item
-int con_idx_2 = 0;
-// Initialize the mutex for buffer 2
-pthread_mutex_t mutex_2 = PTHREAD_MUTEX_INITIALIZER;
-// Initialize the condition variable for buffer 2
-pthread_cond_t full_2 = PTHREAD_COND_INITIALIZER;
-
-
-// Buffer 3, shared resource between plus sign thread and output thread
-char buffer_3[SIZE];
-// Number of items in the buffer
-int count_3 = 0;
-// Index where the square-root thread will put the next item
-int prod_idx_3 = 0;
-// Index where the output thread will pick up the next item
-int con_idx_3 = 0;
-// Initialize the mutex for buffer 3
-pthread_mutex_t mutex_3 = PTHREAD_MUTEX_INITIALIZER;
-// Initialize the condition variable for buffer 3
-pthread_cond_t full_3 = PTHREAD_COND_INITIALIZER;
-
-/*
-Get the next item from buffer 1
-*/
-char get_buff_1(){
-  // Lock the mutex before checking if the buffer has data
-  pthread_mutex_lock(&mutex_1);
-  while (count_1 == 0)
-    // Buffer is empty. Wait for the producer to signal that the buffer has data
-    pthread_cond_wait(&full_1, &mutex_1);
-  char item = buffer_1[con_idx_1];
-  // Increment the index from which the item will be picked up from wrap
-  con_idx_1 = (con_idx_1 + 1) % SIZE;
-  count_1--;
-  // Unlock the mutex
-  pthread_mutex_unlock(&mutex_1);
-  // Return the item
-  return item;
+  Input ends at end of file or at a line that says exactly STOP. Regular files are mapped rather than read.
+- Line separator stage replaces every line separator in the input by a space.
+- Plus sign stage replaces "++" with a "^".
+- Any number of literal substitutions given with -s FROM=TO follow, in the order given.
+- Output stage consumes items from the buffer it shares with the stage before it and prints the items as standard out, 80 characters per line.
+- Each stage between the input and the output consumes from the buffer in front of it and produces into the buffer behind it,
+  so it implements both consumer and producer functionalities. All buffers are the same bounded queue.
+- Adjacent stages can be fused onto one thread (-t THREADS), down to a single loop that runs every stage (-m fused).
+- Alternatively the input can be cut into chunks that THREADS workers process in parallel (-m sharded).
+  By default small files are processed fused, very large files are sharded on machines with more cores than stages,
+  and other inputs get one thread per stage, up to the number of cores.
+- The buffers between threads hold 64 KiB by default (-q BYTES). A producer waits while the buffer is full.
+- Statistics on each stage, thread and buffer are printed to standard error on exit with -S, or at any time on SIGUSR1.
+  -B MEGABYTES benchmarks every mode over generated inputs of that size and reports the throughput.
+*/
+
+// Default capacity of the buffers between threads
+#define QUEUE_SIZE 65536
+
+// Fewest items a consumer asks for at once
+#define MIN_BATCH 512
+
+// Width of an output line
+#define LINE_WIDTH 80
+
+// Size of the blocks a thread works on when it reads standard in itself
+#define BLOCK_SIZE 65536
+
+// Regular files smaller than this are processed by a single fused loop
+#define FUSE_THRESHOLD (4 * 1024 * 1024)
+
+// Regular files of at least this size are sharded across all cores
+#define SHARD_THRESHOLD (64 * 1024 * 1024)
+
+// Size of the chunk each worker takes per round in sharded mode
+#define SHARD_CHUNK (1024 * 1024)
+
+// Most stages a pipeline can have
+#define MAX_STAGES 64
+
+// Input, line separator, plus sign and output
+#define NUM_BUILTIN_STAGES 4
+
+// Number of buckets in the queue occupancy histograms
+#define OCCUPANCY_BUCKETS 8
+
+// Counters read by the statistics report while the threads are running
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Where the output stage writes to
+int output_fd = STDOUT_FILENO;
+
+// Capacity of the buffers between threads
+size_t queue_capacity = QUEUE_SIZE;
+
+/*
+ Current time in nanoseconds, for the statistics.
+*/
+unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
- Put an item in buff_1
+ Print the reason for the last failed call and give up.
 */
-void put_buff_1(char item){
-  // Lock the mutex before putting the item in the buffer
-  pthread_mutex_lock(&mutex_1);
-  // Put the item in the buffer
-  buffer_1[prod_idx_1] = item;
-  // Increment the index where the next item will be put and wrap if necessary
-  prod_idx_1 = (prod_idx_1 + 1) % SIZE;
-  count_1++;
-  // Signal to the consumer that the buffer is no longer empty
-  pthread_cond_signal(&full_1);
-  // Unlock the mutex
-  pthread_mutex_unlock(&mutex_1);
+void die(const char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
 }
 
 /*
-Get the next item from buffer 2
+ A growable byte buffer that a stage writes its result into.
 */
-char get_buff_2(){
-   // Lock the mutex before checking if the buffer has data
-  pthread_mutex_lock(&mutex_2);
-  while (count_2 == 0)
-    // Buffer is empty. Wait for the producer to signal that the buffer has data
-    pthread_cond_wait(&full_2, &mutex_2);
-  char item = buffer_2[con_idx_2];
-  // Increment the index from which the item will be picked up from wrap
-  con_idx_2 = (con_idx_2 + 1) % SIZE;
-  count_2--;
-  // Unlock the mutex
-  pthread_mutex_unlock(&mutex_2);
-  // Return the item
-  return item;
-}
-/*
- Put an item in buff_2
-*/
-void put_buff_2(char item){
-  // Lock the mutex before putting the item in the buffer
-  pthread_mutex_lock(&mutex_2);
-  // Put the item in the buffer
-  buffer_2[prod_idx_2] = item;
-  // Increment the index where the next item will be put and wrap if necessary
-  prod_idx_2 = (prod_idx_2 + 1) % SIZE;
-  count_2++;
-  // Signal to the consumer that the buffer is no longer empty
-  pthread_cond_signal(&full_2);
-  // Unlock the mutex
-  pthread_mutex_unlock(&mutex_2);
+struct buf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+/*
+ Make room for n more bytes at the end of b and return where they go.
+*/
+char *buf_reserve(struct buf *b, size_t n) {
+  if (b->data == NULL || b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + n) {
+      cap *= 2;
+    }
+    char *data = realloc(b->data, cap);
+    if (data == NULL) {
+      die("line_processor");
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+  return b->data + b->len;
 }
+
+void buf_append(struct buf *b, const char *src, size_t n) {
+  memcpy(buf_reserve(b, n), src, n);
+  b->len += n;
+}
+
 /*
-Get the next item from buffer 3
+ A bounded buffer, shared resource between a producer thread and a consumer thread.
+ The producer closes it after putting its last item.
 */
-char get_buff_3(){
+struct queue {
+  char *buffer;
+  size_t capacity;
+  // Number of items the consumer takes at once. It grows while there is a backlog
+  // and shrinks when the consumer has to wait, so items trickling in are passed on quickly
+  size_t batch;
+  // Number of items in the buffer
+  size_t count;
+  // Index where the producer will put the next item
+  size_t prod_idx;
+  // Index where the consumer will pick up the next item
+  size_t con_idx;
+  // Set once the producer has put its last item
+  bool closed;
+  pthread_mutex_t mutex;
+  // Signalled when the buffer has data or has been closed
+  pthread_cond_t full;
+  // Signalled when the buffer has room again
+  pthread_cond_t empty;
+  // Statistics, updated under the mutex. How often and how long the consumer found the
+  // buffer empty and the producer found it full, and how full it was at each get
+  unsigned long long gets;
+  unsigned long long empty_waits;
+  unsigned long long empty_wait_ns;
+  unsigned long long full_waits;
+  unsigned long long full_wait_ns;
+  unsigned long long occupancy[OCCUPANCY_BUCKETS];
+  // When the wait in progress started, or 0
+  unsigned long long empty_since;
+  unsigned long long full_since;
+};
+
+/*
+ Empty the queue and its statistics so it can be used again, with room for capacity items.
+*/
+void queue_reset(struct queue *q, size_t capacity) {
+  if (q->capacity != capacity) {
+    free(q->buffer);
+    q->buffer = malloc(capacity);
+    if (q->buffer == NULL) {
+      die("line_processor");
+    }
+    q->capacity = capacity;
+  }
+  q->batch = MIN_BATCH < capacity ? MIN_BATCH : capacity;
+  q->count = q->prod_idx = q->con_idx = 0;
+  q->closed = false;
+  q->gets = q->empty_waits = q->empty_wait_ns = q->full_waits = q->full_wait_ns = 0;
+  q->empty_since = q->full_since = 0;
+  memset(q->occupancy, 0, sizeof q->occupancy);
+}
+
+void queue_init(struct queue *q) {
+  q->buffer = NULL;
+  q->capacity = 0;
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->full, NULL);
+  pthread_cond_init(&q->empty, NULL);
+}
+
+/*
+Get the next batch of items from the queue, at most max. Blocks until at least one item is
+available and returns the number of items copied into dst, or 0 once the queue is closed and drained.
+*/
+size_t queue_get(struct queue *q, char *dst, size_t max) {
   // Lock the mutex before checking if the buffer has data
-  pthread_mutex_lock(&mutex_3);
-  while (count_3 == 0)
-    // Buffer is empty. Wait for the producer to signal that the buffer has data
-    pthread_cond_wait(&full_3, &mutex_3);
-  char item = buffer_3[con_idx_3];
-  // Increment the index from which the item will be picked up from wrap
-  con_idx_3 = (con_idx_3 + 1) % SIZE;
-  count_3--;
-  // Unlock the mutex
-  pthread_mutex_unlock(&mutex_3);
-  // Return the item
-  return item;
-}
-/*
- Put an item in buff_3
-*/
-void put_buff_3(char item){
-  // Lock the mutex before putting the item in the buffer
-  pthread_mutex_lock(&mutex_3);
-  // Put the item in the buffer
-  buffer_3[prod_idx_3] = item;
-  // Increment the index where the next item will be put and wrap if necessary
-  prod_idx_3 = (prod_idx_3 + 1) % SIZE;
-  count_3++;
-  // Signal to the consumer that the buffer is no longer empty
-  pthread_cond_signal(&full_3);
+  pthread_mutex_lock(&q->mutex);
+  q->gets++;
+  q->occupancy[q->count * OCCUPANCY_BUCKETS / (q->capacity + 1)]++;
+  if (q->count >= q->batch) {
+    // Falling behind, take more at once
+    q->batch = 2 * q->batch < q->capacity ? 2 * q->batch : q->capacity;
+  } else if (q->count == 0 && !q->closed) {
+    // Keeping up, take less at once so items are not held up waiting for a full batch
+    q->batch = q->batch / 2 >= MIN_BATCH ? q->batch / 2 : q->batch;
+    q->empty_since = now_ns();
+    q->empty_waits++;
+    while (q->count == 0 && !q->closed)
+      // Buffer is empty. Wait for the producer to signal that the buffer has data
+      pthread_cond_wait(&q->full, &q->mutex);
+    q->empty_wait_ns += now_ns() - q->empty_since;
+    q->empty_since = 0;
+  }
+  if (max > q->batch) {
+    max = q->batch;
+  }
+  size_t n = q->count < max ? q->count : max;
+  // The items may wrap around the end of the buffer, so copy them in at most two pieces
+  size_t first = q->capacity - q->con_idx;
+  if (first > n) {
+    first = n;
+  }
+  memcpy(dst, q->buffer + q->con_idx, first);
+  memcpy(dst + first, q->buffer, n - first);
+  // Increment the index from which the items will be picked up and wrap
+  q->con_idx = (q->con_idx + n) % q->capacity;
+  q->count -= n;
+  // Signal to the producer that the buffer has room
+  pthread_cond_signal(&q->empty);
   // Unlock the mutex
-  pthread_mutex_unlock(&mutex_3);
+  pthread_mutex_unlock(&q->mutex);
+  return n;
 }
 
 /*
-  Function that the input thread will run.
-  Get input from file.
+ Put n items in the queue. Waits for the consumer whenever the buffer is full.
+ The consumer is woken once there is a batch for it, and at the end of the put.
 */
-void *get_input(void *args) {
-  char line[SIZE];
-  while (!stop_processing) {
-    if (fgets(line, SIZE, stdin) == NULL) {
-      break;
+void queue_put(struct queue *q, const char *src, size_t n) {
+  while (n > 0) {
+    // Lock the mutex before putting the items in the buffer
+    pthread_mutex_lock(&q->mutex);
+    if (q->count == q->capacity) {
+      q->full_since = now_ns();
+      q->full_waits++;
+      while (q->count == q->capacity)
+        // Buffer is full. Wait for the consumer to make room
+        pthread_cond_wait(&q->empty, &q->mutex);
+      q->full_wait_ns += now_ns() - q->full_since;
+      q->full_since = 0;
     }
-    size_t len = strlen(line);
-    if (len > 0 && line[len - 1] == '\n') {
-      line[len - 1] = ' ';
-      len--;
+    size_t room = q->capacity - q->count;
+    size_t take = n < room ? n : room;
+    size_t first = q->capacity - q->prod_idx;
+    if (first > take) {
+      first = take;
     }
-    if (strcmp(line, "STOP\n") == 0) {
-      stop_processing = true;
-    } else {
-      for (size_t i = 0; i < len; i++) {
-        put_buff_1(line[i]);
+    memcpy(q->buffer + q->prod_idx, src, first);
+    memcpy(q->buffer, src + first, take - first);
+    // Increment the index where the next item will be put and wrap if necessary
+    q->prod_idx = (q->prod_idx + take) % q->capacity;
+    q->count += take;
+    // Signal to the consumer that the buffer has a batch for it, or is as full as it gets
+    if (q->count >= q->batch || q->count == q->capacity || take == n) {
+      pthread_cond_signal(&q->full);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&q->mutex);
+    src += take;
+    n -= take;
+  }
+}
+
+/*
+ Mark the end of the items. The consumer drains what is left and then sees 0 from queue_get.
+*/
+void queue_close(struct queue *q) {
+  pthread_mutex_lock(&q->mutex);
+  q->closed = true;
+  pthread_cond_signal(&q->full);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ Return the index of the first byte equal to c in buf, or n if there is none.
+ Compares 16 bytes at a time with SSE2 when available.
+*/
+size_t find_byte(const char *buf, size_t n, char c) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (buf[i] == c) {
+      return i;
+    }
+  }
+  return n;
+}
+
+/*
+ Return the length of the run of bytes equal to c at the start of buf.
+*/
+size_t span_byte(const char *buf, size_t n, char c) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)) ^ 0xFFFF;
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (buf[i] != c) {
+      return i;
+    }
+  }
+  return n;
+}
+
+/*
+ Line separator kernel. Copies in to out replacing every line separator by a space.
+ in and out may be the same buffer.
+*/
+void separator_kernel(const char *in, char *out, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i m = _mm_cmpeq_epi8(v, newline);
+    v = _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, space));
+    _mm_storeu_si128((__m128i *)(out + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = in[i] == '\n' ? ' ' : in[i];
+  }
+}
+
+/*
+ Plus sign kernel. Copies in to out replacing every "++" with a "^" and returns the
+ number of bytes written. Text between plus signs is found with a vector scan and
+ copied in bulk. A run of plus signs is paired up from the left, so a run of k plus
+ signs becomes k/2 carets followed by a single plus if k is odd.
+ A lone plus sign at the end of in may pair with the first byte of the next block,
+ so it is held back in *pending instead of being written. out must have room for n + 1 bytes.
+*/
+size_t plus_kernel(const char *in, size_t n, char *out, bool *pending) {
+  char *o = out;
+  size_t i = 0;
+  while (i < n) {
+    if (!*pending) {
+      // Copy everything up to the next plus sign
+      size_t j = i + find_byte(in + i, n - i, '+');
+      memcpy(o, in + i, j - i);
+      o += j - i;
+      i = j;
+      if (i == n) {
+        break;
       }
-      put_buff_1(' ');
     }
+    // Pair up the run of plus signs, including one held back from the last block
+    size_t run = span_byte(in + i, n - i, '+');
+    size_t total = run + *pending;
+    memset(o, '^', total / 2);
+    o += total / 2;
+    i += run;
+    if (i == n) {
+      // The run may continue in the next block
+      *pending = total & 1;
+      break;
+    }
+    if (total & 1) {
+      *o++ = '+';
+    }
+    *pending = false;
   }
-  put_buff_1('\0');
-  return NULL;
+  return o - out;
 }
 
 /*
- Function that the line separator thread will run. It replaces every line separator in the input by a space.
- Consume an item from the buffer shared with the input thread.
- Produce an item in the buffer shared with the plus sign thread.
+ Output kernel. Copies in to out in slices that end at the 80th column, inserting a line
+ separator after each full line, and returns the number of bytes written. *col is the
+ column the next byte lands in and carries over between blocks.
+ out must have room for n + n / LINE_WIDTH + 1 bytes.
+*/
+size_t frame_kernel(const char *in, size_t n, char *out, int *col) {
+  char *o = out;
+  while (n > 0) {
+    size_t take = LINE_WIDTH - *col;
+    if (take > n) {
+      take = n;
+    }
+    memcpy(o, in, take);
+    o += take;
+    in += take;
+    n -= take;
+    *col += take;
+    if (*col == LINE_WIDTH) {
+      *o++ = '\n';
+      *col = 0;
+    }
+  }
+  return o - out;
+}
+
+struct stage;
+
+/*
+ A transform appends the result of processing n bytes of in to out. When eof is set
+ this is the last block, and anything the stage held back must be flushed too.
 */
-void *line_separator(void *args) {
+typedef void transform_fn(struct stage *st, const char *in, size_t n, struct buf *out, bool eof);
+
+/*
+ One stage of the pipeline. The first stage is the input stage, which has no transform,
+ and the last one is the output stage.
+*/
+struct stage {
+  const char *name;
+  transform_fn *transform;
+  // Buffer in front of this stage, used when the stage before it runs on another thread
+  struct queue queue;
+  // A plus sign held back by the plus sign stage until it sees the next byte
+  bool plus_pending;
+  // Column of the next byte written by the output stage
+  int col;
+  // Text replaced by a substitution stage, and its replacement
+  char *from;
+  size_t from_len;
+  char *to;
+  size_t to_len;
+  // Tail of the last block that may be the start of a match
+  struct buf held;
+  // Statistics
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+};
+
+struct stage stages[MAX_STAGES];
+int num_stages = 0;
+
+// Positions of the built-in stages. The output stage is always the last one
+enum {
+  STAGE_INPUT,
+  STAGE_SEPARATOR,
+  STAGE_PLUS
+};
+
+/*
+ A run of adjacent stages executed by one thread, one block at a time.
+*/
+struct group {
+  int first;
+  int last;
+  // When the thread started and finished, 0 while it is still running
+  unsigned long long start_ns;
+  unsigned long long end_ns;
+};
+
+struct group groups[MAX_STAGES];
+int num_groups = 0;
+
+void separator_transform(struct stage *st, const char *in, size_t n, struct buf *out, bool eof) {
+  separator_kernel(in, buf_reserve(out, n), n);
+  out->len += n;
+}
+
+void plus_transform(struct stage *st, const char *in, size_t n, struct buf *out, bool eof) {
+  char *o = buf_reserve(out, n + 2);
+  size_t len = plus_kernel(in, n, o, &st->plus_pending);
+  if (eof && st->plus_pending) {
+    // A plus sign still held back at the end of the input has nothing to pair with
+    o[len++] = '+';
+    st->plus_pending = false;
+  }
+  out->len += len;
+}
+
+/*
+ Replace every occurrence of st->from with st->to, scanning from the left like the plus sign stage.
+ The last from_len - 1 bytes of a block may be the start of a match that ends in the next block,
+ so they are held back and scanned again with it.
+*/
+void substitute_transform(struct stage *st, const char *in, size_t n, struct buf *out, bool eof) {
+  buf_append(&st->held, in, n);
+  const char *text = st->held.data;
+  size_t len = st->held.len;
+  size_t i = 0;
   for (;;) {
-    char item = get_buff_1();
-    if (item == '\0') {
-      put_buff_2('\0');
+    const char *match = memmem(text + i, len - i, st->from, st->from_len);
+    if (match == NULL) {
       break;
-    } else if (item == '\n') {
-      put_buff_2(' ');
+    }
+    buf_append(out, text + i, match - (text + i));
+    buf_append(out, st->to, st->to_len);
+    i = match - text + st->from_len;
+  }
+  size_t keep = eof ? 0 : st->from_len - 1;
+  if (keep > len - i) {
+    keep = len - i;
+  }
+  buf_append(out, text + i, len - i - keep);
+  memmove(st->held.data, text + len - keep, keep);
+  st->held.len = keep;
+}
+
+void frame_transform(struct stage *st, const char *in, size_t n, struct buf *out, bool eof) {
+  char *o = buf_reserve(out, n + n / LINE_WIDTH + 2);
+  size_t len = frame_kernel(in, n, o, &st->col);
+  if (eof && st->col > 0) {
+    // Finish off the last partial line
+    o[len++] = '\n';
+    st->col = 0;
+  }
+  out->len += len;
+}
+
+/*
+ Append a stage to the pipeline.
+*/
+struct stage *add_stage(const char *name, transform_fn *transform) {
+  if (num_stages == MAX_STAGES) {
+    fprintf(stderr, "line_processor: too many stages\n");
+    exit(EXIT_FAILURE);
+  }
+  struct stage *st = &stages[num_stages++];
+  memset(st, 0, sizeof *st);
+  st->name = name;
+  st->transform = transform;
+  queue_init(&st->queue);
+  return st;
+}
+
+/*
+ Undo the escapes in a substitution argument in place: \\, \=, \n and \t.
+ Returns the length of the result.
+*/
+size_t unescape(char *s) {
+  char *start = s;
+  char *o = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1] != '\0') {
+      s++;
+      *o++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
     } else {
-      put_buff_2(item);
+      *o++ = *s;
     }
   }
-  return NULL;
+  *o = '\0';
+  return o - start;
+}
+
+/*
+ Add a substitution stage for an argument of the form FROM=TO. The first '=' that is
+ not escaped separates the two. Returns false if the argument is malformed.
+*/
+bool add_substitution(char *arg) {
+  char *eq = arg;
+  while (*eq && *eq != '=') {
+    if (*eq == '\\' && eq[1] != '\0') {
+      eq++;
+    }
+    eq++;
+  }
+  if (*eq != '=') {
+    return false;
+  }
+  *eq = '\0';
+  struct stage *st = add_stage("substitute", substitute_transform);
+  st->from = arg;
+  st->from_len = unescape(arg);
+  st->to = eq + 1;
+  st->to_len = unescape(eq + 1);
+  return st->from_len > 0;
+}
+
+/*
+ Return the index of the first "STOP\n" line in buf, or n if there is none. A line starts
+ at the beginning of buf if line_start is set, or after a line separator. Candidates are
+ found 16 at a time by looking for an 'S' with a line separator four bytes after it.
+*/
+size_t find_stop(const char *buf, size_t n, bool line_start) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8('S');
+  const __m128i last = _mm_set1_epi8('\n');
+  for (; i + 16 + 4 <= n; i += 16) {
+    __m128i s = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), first);
+    __m128i nl = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 4)), last);
+    int mask = _mm_movemask_epi8(_mm_and_si128(s, nl));
+    while (mask != 0) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (memcmp(buf + pos, "STOP\n", 5) == 0 && (pos == 0 ? line_start : buf[pos - 1] == '\n')) {
+        return pos;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + 5 <= n; i++) {
+    if (buf[i] == 'S' && memcmp(buf + i, "STOP\n", 5) == 0 && (i == 0 ? line_start : buf[i - 1] == '\n')) {
+      return i;
+    }
+  }
+  return n;
+}
+
+/*
+ State of the input stage. Regular files are mapped and handed out in place, anything
+ else is read with read(2) into a buffer. Input ends at end of file or at a line
+ that says exactly STOP; a last line without a line separator gets one.
+*/
+struct input {
+  bool started;
+  // Set once the STOP line has been seen
+  bool stopped;
+  bool at_eof;
+  // Whether the last byte handed out was a line separator, or nothing has been
+  bool line_start;
+  // The mapped file and how far into it has been handed out
+  const char *map;
+  size_t map_len;
+  size_t map_pos;
+  // Buffer for read(2). The first held bytes may be the start of a STOP line and are kept for the next read
+  char *buf;
+  size_t buf_cap;
+  size_t held_off;
+  size_t held;
+  // Time spent blocked in read(2), which counts as waiting on an empty buffer
+  unsigned long long read_ns;
+} input;
+
+/*
+ Length of the tail of buf[0..n) that may be the beginning of a STOP line split by a read.
+*/
+size_t stop_prefix(const char *buf, size_t n, bool line_start) {
+  for (size_t k = n < 4 ? n : 4; k > 0; k--) {
+    size_t pos = n - k;
+    if (memcmp(buf + pos, "STOP", k) == 0 && (pos == 0 ? line_start : buf[pos - 1] == '\n')) {
+      return k;
+    }
+  }
+  return 0;
+}
+
+/*
+ Offset of standard in, a regular file of st_size bytes, that whatever ran before left it
+ at, clamped to the file. Input starts there rather than at the beginning of the file.
+*/
+off_t input_offset(off_t st_size) {
+  off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+  return offset < 0 ? 0 : offset > st_size ? st_size : offset;
+}
+
+/*
+ Hand out the next part of a mapped file, up to max bytes.
+*/
+const char *read_mapped(size_t max, size_t *n) {
+  size_t pos = input.map_pos;
+  size_t len = input.map_len - pos < max ? input.map_len - pos : max;
+  // Look a few bytes past the end, so a STOP line across the boundary is found now
+  size_t look = input.map_len - pos < len + 4 ? input.map_len - pos : len + 4;
+  size_t stop = find_stop(input.map + pos, look, input.line_start);
+  if (stop < look && stop <= len) {
+    input.stopped = true;
+    len = stop;
+  }
+  input.map_pos += len;
+  if (input.map_pos == input.map_len) {
+    input.at_eof = true;
+  }
+  *n = len;
+  return input.map + pos;
+}
+
+/*
+ Index of the first STOP line in buf[from..n), or n if there is none, where the start of
+ buf is a line start if line_start is set.
+*/
+size_t find_stop_from(const char *buf, size_t from, size_t n, bool line_start) {
+  return from + find_stop(buf + from, n - from, from == 0 ? line_start : buf[from - 1] == '\n');
 }
+
 /*
- Function that the plus sign thread will run. It replaces two plus signs with a caret symbol.
- Consume an item from the buffer shared with the input thread.
- Produce an item in the buffer shared with the output thread.
+ Read up to max bytes with read(2). Unless fill is set this returns as soon as some
+ input is available, so lines typed at a terminal go through one at a time. With fill
+ set it still returns as soon as a STOP line has come in.
 */
-void *plus_sign(void *args) {
-  bool prev_plus = false;
+const char *read_unmapped(size_t max, bool fill, size_t *n) {
+  if (input.buf_cap < max + 1) {
+    char *buf = malloc(max + 1);
+    if (buf == NULL) {
+      die("line_processor");
+    }
+    memcpy(buf, input.buf + input.held_off, input.held);
+    free(input.buf);
+    input.buf = buf;
+    input.buf_cap = max + 1;
+  } else {
+    memmove(input.buf, input.buf + input.held_off, input.held);
+  }
+  size_t len = input.held;
+  // Everything before this has been looked at for the start of a STOP line
+  size_t scanned = 0;
+  size_t out;
   for (;;) {
-    char item = get_buff_2();
-    if (item == '\0') {
-      put_buff_3('\0');
+    while (len < max && !input.at_eof) {
+      unsigned long long start = now_ns();
+      ssize_t r = read(STDIN_FILENO, input.buf + len, max - len);
+      STAT_ADD(input.read_ns, now_ns() - start);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        die("line_processor: read");
+      }
+      if (r == 0) {
+        input.at_eof = true;
+      }
+      len += r;
+      if (!fill && r > 0) {
+        break;
+      }
+      // Look at each chunk as it comes, so a STOP line does not wait for the rest to fill
+      if (find_stop_from(input.buf, scanned, len, input.line_start) < len) {
+        break;
+      }
+      scanned = len < 4 ? 0 : len - 4;
+    }
+    out = find_stop_from(input.buf, scanned, len, input.line_start);
+    if (out < len) {
+      input.stopped = true;
       break;
     }
-    if (item == '+') {
-      if (prev_plus) {
-        put_buff_3('^');
-        prev_plus = false;
-      } else {
-        prev_plus = true;
+    out = input.at_eof ? len : len - stop_prefix(input.buf, len, input.line_start);
+    if (out > 0 || input.at_eof) {
+      break;
+    }
+  }
+  input.held_off = out;
+  input.held = input.stopped || input.at_eof ? 0 : len - out;
+  *n = out;
+  return input.buf;
+}
+
+/*
+ Start over with the input read from memory instead of standard in.
+*/
+void input_from_memory(const char *data, size_t len) {
+  free(input.buf);
+  memset(&input, 0, sizeof input);
+  input.started = true;
+  input.line_start = true;
+  input.map = data;
+  input.map_len = len;
+}
+
+/*
+ Get the next block of input, up to max bytes. Returns a pointer to the block, valid until
+ the next call, and stores its length in *n, which is 0 once the input is exhausted.
+ There is no limit on the length of a line.
+*/
+const char *read_input(size_t max, bool fill, size_t *n) {
+  if (!input.started) {
+    input.started = true;
+    input.line_start = true;
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+      // Mappings start on a page, so map from the page the offset is in and skip up to it
+      off_t offset = input_offset(st.st_size);
+      off_t page = offset - offset % sysconf(_SC_PAGESIZE);
+      void *map = offset < st.st_size ? mmap(NULL, st.st_size - page, PROT_READ, MAP_PRIVATE, STDIN_FILENO, page) : MAP_FAILED;
+      if (map != MAP_FAILED) {
+        madvise(map, st.st_size - page, MADV_SEQUENTIAL);
+        input.map = map;
+        input.map_len = st.st_size - page;
+        input.map_pos = offset - page;
       }
+    }
+  }
+  *n = 0;
+  if (input.stopped || (input.at_eof && input.held == 0)) {
+    if (!input.stopped && !input.line_start) {
+      // The last line had no line separator
+      input.line_start = true;
+      *n = 1;
+      return "\n";
+    }
+    return "";
+  }
+  const char *block = input.map ? read_mapped(max, n) : read_unmapped(max, fill, n);
+  if (*n > 0) {
+    input.line_start = block[*n - 1] == '\n';
+  }
+  if (*n == 0) {
+    return read_input(max, fill, n);
+  }
+  return block;
+}
+
+/*
+ Write n bytes to standard out, continuing after partial writes.
+*/
+void write_all(const char *data, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(output_fd, data, n);
+    if (w < 0) {
+      die("line_processor: write");
+    }
+    data += w;
+    n -= w;
+  }
+}
+
+/*
+ Run the transforms of stages first..last over the n bytes in block, alternating
+ between the two scratch buffers. When eof is set, anything the stages hold back
+ is flushed as well. Returns the result and stores its length in *n.
+*/
+const char *run_stages(int first, int last, const char *block, size_t *n, bool eof, struct buf scratch[2]) {
+  const char *data = block;
+  size_t len = *n;
+  int which = 0;
+  for (int i = first; i <= last; i++) {
+    if (stages[i].transform == NULL) {
+      continue;
+    }
+    struct buf *out = &scratch[which];
+    which ^= 1;
+    out->len = 0;
+    stages[i].transform(&stages[i], data, len, out, eof);
+    STAT_ADD(stages[i].bytes_in, len);
+    STAT_ADD(stages[i].bytes_out, out->len);
+    data = out->data;
+    len = out->len;
+  }
+  *n = len;
+  return data;
+}
+
+/*
+ Function that each pipeline thread will run. It runs a group of adjacent stages:
+ it consumes blocks from the buffer in front of its first stage, or reads standard in
+ if it runs the input stage, and produces into the buffer behind its last stage, or
+ prints the result if it runs the output stage.
+ A single group holding every stage is the fused mode: one loop over a large block, no handoffs.
+*/
+void *run_group(void *args) {
+  struct group *g = args;
+  bool reads_input = g->first == 0;
+  bool writes_output = g->last == num_stages - 1;
+  STAT_ADD(g->start_ns, now_ns());
+  char *buf = malloc(queue_capacity);
+  struct buf scratch[2] = {{0}};
+  if (buf == NULL) {
+    die("line_processor");
+  }
+  bool eof = false;
+  while (!eof) {
+    size_t n;
+    const char *block = buf;
+    if (reads_input) {
+      block = read_input(BLOCK_SIZE, false, &n);
+      STAT_ADD(stages[STAGE_INPUT].bytes_out, n);
     } else {
-      if (prev_plus) {
-        put_buff_3('+');
-        prev_plus = false;
-      }
-      put_buff_3(item);
+      n = queue_get(&stages[g->first].queue, buf, queue_capacity);
     }
+    eof = n == 0;
+    const char *out = run_stages(g->first, g->last, block, &n, eof, scratch);
+    if (writes_output) {
+      write_all(out, n);
+    } else {
+      queue_put(&stages[g->last + 1].queue, out, n);
+    }
+  }
+  if (!writes_output) {
+    queue_close(&stages[g->last + 1].queue);
   }
+  free(scratch[0].data);
+  free(scratch[1].data);
+  free(buf);
+  STAT_ADD(g->end_ns, now_ns());
   return NULL;
 }
 
 /*
- Function that the output thread will run.
- Prints the items.
+ Sharded mode. The input is read in rounds and each round is cut into one chunk per
+ worker thread, so throughput scales with the number of cores rather than the number
+ of stages. Only the built-in stages can be sharded.
+ A chunk cannot know whether the chunk before it ended with a lone plus sign, so each
+ worker assumes it did not. After the workers are done a sequential pass walks the
+ chunks in order, works out the real carry into each one and fixes up the start of
+ its output, which changes at most one byte. The same pass works out the column each
+ chunk starts at, so the workers can then frame their chunks in parallel as well.
 */
-void *write_output(void *args) {
-  char line[81] = {0};
-  int idx = 0;
-  for (;;) {
-    char item = get_buff_3();
-    if (item == '\0') {
-      if (idx > 0) {
-        line[idx] = '\n';
-        write(STDOUT_FILENO, line, idx + 1);
-        idx = 0;
+struct shard {
+  // This worker's part of the round
+  const char *data;
+  size_t len;
+  struct buf sep_out;
+  struct buf plus_out;
+  struct buf frame_out;
+  // Number of plus signs the chunk starts with
+  size_t lead;
+  // A plus sign held back at the end of the chunk, assuming none was carried into it
+  bool pending;
+  // Byte the fix-up pass inserts at insert_pos, if any
+  bool insert;
+  size_t insert_pos;
+  char insert_char;
+  // Column the chunk's output starts at
+  int col;
+  // Time spent working rather than waiting for the other threads
+  unsigned long long busy_ns;
+};
+
+struct shard *shards;
+int num_shards;
+// Workers and the main thread meet here between the phases of a round
+pthread_barrier_t shard_barrier;
+bool shards_done = false;
+
+/*
+ First phase: replace line separators and pairs of plus signs, as if nothing was carried in.
+*/
+void shard_transform(struct shard *sh) {
+  sh->sep_out.len = 0;
+  separator_kernel(sh->data, buf_reserve(&sh->sep_out, sh->len), sh->len);
+  sh->sep_out.len = sh->len;
+  sh->lead = span_byte(sh->sep_out.data, sh->len, '+');
+  sh->pending = false;
+  sh->plus_out.len = 0;
+  sh->plus_out.len = plus_kernel(sh->sep_out.data, sh->len, buf_reserve(&sh->plus_out, sh->len + 1), &sh->pending);
+}
+
+/*
+ Second phase, run by the main thread: work out the real carry into each chunk, fix up
+ the start of its output and the column it starts at. A chunk starting with L plus signs
+ wrote L / 2 carets, then a plus sign if L is odd and the run ended inside the chunk.
+ With one more plus sign carried in, the run is one longer. Returns the carry out of the last chunk.
+*/
+bool shard_fixup(bool carry, int *col) {
+  for (int i = 0; i < num_shards; i++) {
+    struct shard *sh = &shards[i];
+    bool all_plus = sh->lead == sh->len;
+    sh->insert = false;
+    sh->insert_pos = sh->lead / 2;
+    if (carry) {
+      if (all_plus) {
+        if (sh->lead & 1) {
+          // The carried plus sign completes the last pair
+          sh->insert = true;
+          sh->insert_char = '^';
+        }
+      } else if (sh->lead & 1) {
+        // The trailing plus sign of the run now pairs up
+        sh->plus_out.data[sh->insert_pos] = '^';
+      } else {
+        // The carried plus sign is left over after the run
+        sh->insert = true;
+        sh->insert_char = '+';
       }
+    }
+    carry = all_plus ? (carry + sh->lead) & 1 : sh->pending;
+    sh->col = *col;
+    *col = (*col + sh->plus_out.len + sh->insert) % LINE_WIDTH;
+  }
+  return carry;
+}
+
+/*
+ Third phase: frame the fixed up output of a chunk, starting at its column.
+*/
+void shard_frame(struct shard *sh) {
+  size_t n = sh->plus_out.len + 1;
+  sh->frame_out.len = 0;
+  char *o = buf_reserve(&sh->frame_out, n + n / LINE_WIDTH + 2);
+  int col = sh->col;
+  size_t split = sh->insert ? sh->insert_pos : sh->plus_out.len;
+  size_t len = frame_kernel(sh->plus_out.data, split, o, &col);
+  if (sh->insert) {
+    len += frame_kernel(&sh->insert_char, 1, o + len, &col);
+    len += frame_kernel(sh->plus_out.data + split, sh->plus_out.len - split, o + len, &col);
+  }
+  sh->frame_out.len = len;
+}
+
+/*
+ Function that each sharded worker thread will run, one chunk per round.
+*/
+void *shard_worker(void *args) {
+  struct shard *sh = args;
+  for (;;) {
+    pthread_barrier_wait(&shard_barrier);
+    if (shards_done) {
       break;
     }
-    line[idx++] = item;
-    if (idx == 80) {
-      line[idx] = '\n';
-      write(STDOUT_FILENO, line, 81);
-      idx = 0;
+    unsigned long long start = now_ns();
+    shard_transform(sh);
+    STAT_ADD(sh->busy_ns, now_ns() - start);
+    pthread_barrier_wait(&shard_barrier);
+    // The main thread fixes up the chunks here
+    pthread_barrier_wait(&shard_barrier);
+    start = now_ns();
+    shard_frame(sh);
+    STAT_ADD(sh->busy_ns, now_ns() - start);
+    pthread_barrier_wait(&shard_barrier);
+  }
+  return NULL;
+}
+
+/*
+ Run the sharded mode with the given number of worker threads.
+*/
+void run_sharded(int workers) {
+  // print_stats() may run from the SIGUSR1 thread at any point, so it is only told about
+  // the shards once they exist
+  __atomic_store_n(&num_shards, 0, __ATOMIC_RELEASE);
+  free(shards);
+  shards_done = false;
+  shards = calloc(workers, sizeof *shards);
+  pthread_t *tids = malloc(workers * sizeof *tids);
+  size_t round_size = (size_t)workers * SHARD_CHUNK;
+  if (shards == NULL || tids == NULL) {
+    die("line_processor");
+  }
+  __atomic_store_n(&num_shards, workers, __ATOMIC_RELEASE);
+  pthread_barrier_init(&shard_barrier, NULL, workers + 1);
+  for (int i = 0; i < workers; i++) {
+    pthread_create(&tids[i], NULL, shard_worker, &shards[i]);
+  }
+  bool carry = false;
+  int col = 0;
+  size_t n;
+  const char *round;
+  while ((round = read_input(round_size, true, &n)), n > 0) {
+    size_t per = (n + workers - 1) / workers;
+    for (int i = 0; i < workers; i++) {
+      size_t start = (size_t)i * per < n ? (size_t)i * per : n;
+      shards[i].data = round + start;
+      shards[i].len = n - start < per ? n - start : per;
+    }
+    pthread_barrier_wait(&shard_barrier);
+    pthread_barrier_wait(&shard_barrier);
+    carry = shard_fixup(carry, &col);
+    pthread_barrier_wait(&shard_barrier);
+    pthread_barrier_wait(&shard_barrier);
+    // Write the chunks out in order
+    for (int i = 0; i < workers; i++) {
+      write_all(shards[i].frame_out.data, shards[i].frame_out.len);
+      STAT_ADD(stages[STAGE_SEPARATOR].bytes_in, shards[i].len);
+      STAT_ADD(stages[STAGE_SEPARATOR].bytes_out, shards[i].len);
+      STAT_ADD(stages[STAGE_PLUS].bytes_in, shards[i].len);
+      STAT_ADD(stages[STAGE_PLUS].bytes_out, shards[i].plus_out.len + shards[i].insert);
+      STAT_ADD(stages[num_stages - 1].bytes_in, shards[i].plus_out.len + shards[i].insert);
+      STAT_ADD(stages[num_stages - 1].bytes_out, shards[i].frame_out.len);
+    }
+    STAT_ADD(stages[STAGE_INPUT].bytes_out, n);
+  }
+  shards_done = true;
+  pthread_barrier_wait(&shard_barrier);
+  for (int i = 0; i < workers; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  // Flush a plus sign still held back and finish off the last partial line
+  char tail[LINE_WIDTH + 2];
+  size_t len = carry ? frame_kernel("+", 1, tail, &col) : 0;
+  if (col > 0) {
+    tail[len++] = '\n';
+  }
+  write_all(tail, len);
+  STAT_ADD(stages[num_stages - 1].bytes_out, len);
+  for (int i = 0; i < workers; i++) {
+    free(shards[i].sep_out.data);
+    free(shards[i].plus_out.data);
+    free(shards[i].frame_out.data);
+  }
+  pthread_barrier_destroy(&shard_barrier);
+  free(tids);
+}
+
+/*
+ Split the stages among the given number of threads. The input stage always gets a
+ thread of its own, since it spends its time blocked on standard in, and the remaining
+ stages are shared out with the earlier groups taking the extra stages.
+ One thread runs everything in a single group.
+*/
+int make_groups(struct group groups[], int threads) {
+  if (threads <= 1) {
+    groups[0].first = 0;
+    groups[0].last = num_stages - 1;
+    return 1;
+  }
+  if (threads > num_stages) {
+    threads = num_stages;
+  }
+  groups[0].first = groups[0].last = 0;
+  int workers = threads - 1;
+  int rest = num_stages - 1;
+  for (int i = 0; i < workers; i++) {
+    groups[i + 1].first = 1 + (i * rest + workers - 1) / workers;
+    groups[i + 1].last = ((i + 1) * rest + workers - 1) / workers;
+  }
+  return threads;
+}
+
+// How the pipeline is run
+enum mode {
+  MODE_AUTO,
+  MODE_FUSED,
+  MODE_PIPELINE,
+  MODE_SHARDED
+};
+
+enum mode current_mode = MODE_AUTO;
+
+long online_cores(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores < 1 ? 1 : cores;
+}
+
+/*
+ Pick the mode when none was given. Regular files smaller than FUSE_THRESHOLD are
+ cheaper to process in one loop than to hand between threads. Regular files of at least
+ SHARD_THRESHOLD are sharded when there are more cores than stages to keep busy, as
+ long as there are only the built-in stages. Everything else gets one thread per stage,
+ or as many as there are cores.
+*/
+enum mode auto_mode(int *threads) {
+  struct stat st;
+  long cores = online_cores();
+  bool regular = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+  off_t size = regular ? st.st_size - input_offset(st.st_size) : 0;
+  if (regular && size < FUSE_THRESHOLD) {
+    *threads = 1;
+    return MODE_FUSED;
+  }
+  if (regular && size >= SHARD_THRESHOLD && cores > num_stages && num_stages == NUM_BUILTIN_STAGES) {
+    *threads = cores;
+    return MODE_SHARDED;
+  }
+  *threads = cores < num_stages ? (int)cores : num_stages;
+  return *threads == 1 ? MODE_FUSED : MODE_PIPELINE;
+}
+
+/*
+ Empty the buffers and the state the stages carry between blocks, so the pipeline can run again.
+*/
+void reset_stages(void) {
+  for (int i = 0; i < num_stages; i++) {
+    struct stage *st = &stages[i];
+    queue_reset(&st->queue, queue_capacity);
+    st->plus_pending = false;
+    st->col = 0;
+    st->held.len = 0;
+    st->bytes_in = st->bytes_out = 0;
+  }
+}
+
+/*
+ Run the pipeline in the given mode, which has been resolved from MODE_AUTO already.
+*/
+void run(enum mode mode, int threads) {
+  current_mode = mode;
+  if (mode == MODE_SHARDED) {
+    run_sharded(threads > 0 ? threads : (int)online_cores());
+    return;
+  }
+  num_groups = make_groups(groups, mode == MODE_FUSED ? 1 : threads > 0 ? threads : MAX_STAGES);
+  if (num_groups == 1) {
+    // Fused mode, run every stage on this thread
+    run_group(&groups[0]);
+    return;
+  }
+  pthread_t tids[MAX_STAGES];
+  // Create the threads
+  for (int i = 0; i < num_groups; i++) {
+    pthread_create(&tids[i], NULL, run_group, &groups[i]);
+  }
+  // Wait for the threads to terminate
+  for (int i = 0; i < num_groups; i++) {
+    pthread_join(tids[i], NULL);
+  }
+}
+
+double ns_to_ms(unsigned long long ns) {
+  return ns / 1e6;
+}
+
+/*
+ Print the statistics gathered so far: bytes through each stage, how each thread splits
+ its time between working and waiting on an empty buffer in front of it or a full one
+ behind it, and how full each buffer was whenever its consumer came to get items.
+*/
+void print_stats(FILE *f) {
+  static const char *const mode_names[] = {"auto", "fused", "pipeline", "sharded"};
+  unsigned long long now = now_ns();
+  fprintf(f, "mode %s\n", mode_names[current_mode]);
+  fprintf(f, "%-12s %14s %14s\n", "stage", "bytes in", "bytes out");
+  for (int i = 0; i < num_stages; i++) {
+    fprintf(f, "%-12s %14llu %14llu\n", stages[i].name, STAT_GET(stages[i].bytes_in), STAT_GET(stages[i].bytes_out));
+  }
+  if (current_mode == MODE_SHARDED) {
+    fprintf(f, "%-12s %12s\n", "worker", "busy ms");
+    int n = __atomic_load_n(&num_shards, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+      fprintf(f, "%-12d %12.1f\n", i, ns_to_ms(STAT_GET(shards[i].busy_ns)));
+    }
+    return;
+  }
+  fprintf(f, "%-12s %-10s %12s %12s %12s\n", "thread", "stages", "busy ms", "empty ms", "full ms");
+  for (int i = 0; i < num_groups; i++) {
+    struct group *g = &groups[i];
+    unsigned long long start = STAT_GET(g->start_ns);
+    unsigned long long end = STAT_GET(g->end_ns);
+    if (start == 0) {
+      continue;
+    }
+    unsigned long long empty = 0, full = 0;
+    if (g->first == STAGE_INPUT) {
+      empty = STAT_GET(input.read_ns);
+    } else {
+      struct queue *q = &stages[g->first].queue;
+      pthread_mutex_lock(&q->mutex);
+      empty = q->empty_wait_ns + (q->empty_since ? now - q->empty_since : 0);
+      pthread_mutex_unlock(&q->mutex);
+    }
+    if (g->last < num_stages - 1) {
+      struct queue *q = &stages[g->last + 1].queue;
+      pthread_mutex_lock(&q->mutex);
+      full = q->full_wait_ns + (q->full_since ? now - q->full_since : 0);
+      pthread_mutex_unlock(&q->mutex);
+    }
+    unsigned long long wall = (end ? end : now) - start;
+    unsigned long long busy = wall > empty + full ? wall - empty - full : 0;
+    char range[32];
+    snprintf(range, sizeof range, "%d-%d", g->first, g->last);
+    fprintf(f, "%-12d %-10s %12.1f %12.1f %12.1f\n", i, range, ns_to_ms(busy), ns_to_ms(empty), ns_to_ms(full));
+  }
+  if (num_groups == 1) {
+    return;
+  }
+  fprintf(f, "%-12s %10s %12s %12s %8s  %s\n", "queue", "gets", "empty waits", "full waits", "batch", "occupancy % of gets, by eighths of capacity");
+  for (int i = 1; i < num_groups; i++) {
+    struct queue *q = &stages[groups[i].first].queue;
+    pthread_mutex_lock(&q->mutex);
+    fprintf(f, "%-12s %10llu %12llu %12llu %8zu ", stages[groups[i].first].name, q->gets, q->empty_waits, q->full_waits, q->batch);
+    for (int b = 0; b < OCCUPANCY_BUCKETS; b++) {
+      fprintf(f, " %5.1f", q->gets ? 100.0 * q->occupancy[b] / q->gets : 0.0);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    fprintf(f, "\n");
+  }
+}
+
+/*
+ Thread that prints the statistics whenever the process gets SIGUSR1. The signal is
+ blocked in every thread, so this is the only one that receives it.
+*/
+void *stats_thread(void *args) {
+  sigset_t *set = args;
+  int sig;
+  for (;;) {
+    if (sigwait(set, &sig) == 0) {
+      print_stats(stderr);
     }
   }
   return NULL;
 }
 
-int main()
+/*
+ Fill buf with generated text for the benchmark. kind 0 is many short lines, 1 is heavy
+ on plus signs and 2 is a few very long lines.
+*/
+void bench_input(char *buf, size_t len, int kind) {
+  unsigned int seed = 12345;
+  size_t line = 0;
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    unsigned int r = seed >> 16;
+    char c = 'a' + r % 26;
+    if (kind == 0 && r % 8 == 0) {
+      c = '\n';
+    } else if (kind == 1 && r % 2 == 0) {
+      c = '+';
+    } else if (kind == 2 && ++line == 1024 * 1024) {
+      c = '\n';
+      line = 0;
+    } else if (kind == 2 && r % 64 == 0) {
+      c = '+';
+    }
+    buf[i] = c;
+  }
+}
+
+/*
+ Run every mode over each kind of generated input of the given size and report the throughput.
+ Output goes to /dev/null.
+*/
+void run_bench(size_t size) {
+  static const char *const inputs[] = {"newlines", "plus", "long-lines"};
+  struct {
+    const char *name;
+    enum mode mode;
+    int threads;
+  } configs[] = {
+    {"fused", MODE_FUSED, 1},
+    {"pipeline", MODE_PIPELINE, 2},
+    {"pipeline", MODE_PIPELINE, 3},
+    {"pipeline", MODE_PIPELINE, MAX_STAGES},
+    {"sharded", MODE_SHARDED, (int)online_cores()},
+  };
+  char *data = malloc(size);
+  output_fd = open("/dev/null", O_WRONLY);
+  if (data == NULL || output_fd == -1) {
+    die("line_processor");
+  }
+  printf("%-12s %-10s %8s %12s\n", "input", "mode", "threads", "MB/s");
+  for (int k = 0; k < 3; k++) {
+    bench_input(data, size, k);
+    for (size_t c = 0; c < sizeof configs / sizeof configs[0]; c++) {
+      if (configs[c].mode == MODE_SHARDED && num_stages != NUM_BUILTIN_STAGES) {
+        continue;
+      }
+      // A pipeline has no use for more threads than stages; the shards scale with the cores
+      int threads = configs[c].mode == MODE_PIPELINE && configs[c].threads > num_stages ? num_stages : configs[c].threads;
+      input_from_memory(data, size);
+      reset_stages();
+      unsigned long long start = now_ns();
+      run(configs[c].mode, threads);
+      double secs = (now_ns() - start) / 1e9;
+      printf("%-12s %-10s %8d %12.1f\n", inputs[k], configs[c].name, configs[c].mode == MODE_FUSED ? 1 : threads, size / secs / 1e6);
+      fflush(stdout);
+    }
+  }
+  free(data);
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-m auto|fused|pipeline|sharded] [-t THREADS] [-s FROM=TO]... [-q BYTES] [-S] < FILE\n", prog);
+  fprintf(stderr, "       %s -B MEGABYTES [-s FROM=TO]... [-q BYTES]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
 {
-    srand(time(0));
-    pthread_t input_t, line_separator_t, plus_sign_t, output_t;
-    // Create the threads
-    pthread_create(&input_t, NULL, get_input, NULL);
-    pthread_create(&line_separator_t, NULL, line_separator, NULL);
-    pthread_create(&plus_sign_t, NULL, plus_sign, NULL);
-    pthread_create(&output_t, NULL, write_output, NULL);
-    // Wait for the threads to terminate
-    pthread_join(input_t, NULL);
-    pthread_join(line_separator_t, NULL);
-    pthread_join(plus_sign_t, NULL);
-    pthread_join(output_t, NULL);
+    // The built-in stages come first, then the substitutions in the order given
+    add_stage("input", NULL);
+    add_stage("separator", separator_transform);
+    add_stage("plus", plus_transform);
+    enum mode mode = MODE_AUTO;
+    int threads = 0;
+    bool stats = false;
+    size_t bench_size = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:s:q:SB:")) != -1) {
+      switch (opt) {
+      case 'm':
+        if (strcmp(optarg, "fused") == 0) {
+          mode = MODE_FUSED;
+        } else if (strcmp(optarg, "pipeline") == 0) {
+          mode = MODE_PIPELINE;
+        } else if (strcmp(optarg, "sharded") == 0) {
+          mode = MODE_SHARDED;
+        } else if (strcmp(optarg, "auto") == 0) {
+          mode = MODE_AUTO;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          usage(argv[0]);
+        }
+        break;
+      case 's':
+        if (!add_substitution(optarg)) {
+          usage(argv[0]);
+        }
+        break;
+      case 'q':
+        queue_capacity = strtoul(optarg, NULL, 10);
+        if (queue_capacity == 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'S':
+        stats = true;
+        break;
+      case 'B':
+        bench_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+        if (bench_size == 0) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+      }
+    }
+    add_stage("output", frame_transform);
+    if (bench_size > 0) {
+      run_bench(bench_size);
+      return EXIT_SUCCESS;
+    }
+    if (mode == MODE_AUTO) {
+      if (threads > 0) {
+        // Fuse adjacent stages to fit the threads given
+        mode = MODE_PIPELINE;
+      } else {
+        mode = auto_mode(&threads);
+      }
+    }
+    if (mode == MODE_SHARDED && num_stages != NUM_BUILTIN_STAGES) {
+      fprintf(stderr, "line_processor: substitutions cannot be sharded\n");
+      exit(EXIT_FAILURE);
+    }
+    // Print the statistics on SIGUSR1
+    static sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_t stats_tid;
+    pthread_create(&stats_tid, NULL, stats_thread, &usr1);
+    pthread_detach(stats_tid);
+    reset_stages();
+    run(mode, threads);
+    if (stats) {
+      print_stats(stderr);
+    }
     //printf("All threads have completed.\n");
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -12,39 +12,227 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #ifndef MAX_WORDS
 #define MAX_WORDS 512
 #endif
 
-#ifndef MAX_LINE_LENGTH
-#define MAX_LINE_LENGTH 1024
+#ifndef ARENA_BLOCK
+#define ARENA_BLOCK 4096
 #endif
 
+// Marks a parameter in a word from wordsplit(), followed by '$', '?', '!' or '{NAME}'.
+// A literal PARAM byte is written twice
+#define PARAM '\x01'
+
+#ifndef MAX_PIPELINE
+#define MAX_PIPELINE 64
+#endif
+
+#ifndef FINISHED_JOBS
+#define FINISHED_JOBS 16
+#endif
+
+#ifndef MAX_EVENTS
+#define MAX_EVENTS 64
+#endif
+
+#ifndef INPUT_BLOCK
+#define INPUT_BLOCK 65536
+#endif
+
+#ifndef ACCT_HISTORY
+#define ACCT_HISTORY 32
+#endif
+
+#ifndef HASH_BUCKETS
+#define HASH_BUCKETS 64
+#endif
+
+// One command of a pipeline. argv points into the words array and is NULL-terminated
+struct command {
+  char** argv;
+  char* input_file;
+  char* output_file;
+  int append;
+};
+
+// A command the shell runs itself. run() returns the exit status
+struct builtin {
+  const char* name;
+  int (*run)(char* argv[]);
+};
+
+// Memory for the words of a line. A word is built at the end of the current block and
+// never moves once finished; the blocks are kept and reused after arena_reset()
+struct arena_block {
+  struct arena_block* next;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block* first;
+  struct arena_block* block; // The block being filled
+  size_t used;               // Bytes of finished words in block
+  size_t len;                // Bytes of the word being built, after those
+};
+
+// A command name remembered with the path it was found at in PATH
+struct hash_entry {
+  char* name;
+  char* path;
+  unsigned hits;
+  struct hash_entry* next;
+};
+
+enum job_kind { JOB_FOREGROUND, JOB_BACKGROUND, JOB_PARALLEL };
+
+// A process of a job. Its pidfd becomes readable when it exits; -1 once it is reaped, or
+// when the kernel has no pidfds
+struct child {
+  pid_t pid;
+  int pidfd;
+  struct job* job;
+  int64_t start_ns; // When the shell began starting it
+  int64_t spawn_ns; // How long posix_spawn or fork took
+  char command[32]; // argv[0], for accounting
+};
+
+// A pipeline the shell started, kept in the jobs list until all of its processes are
+// reaped. Its status is that of the last command
+struct job {
+  enum job_kind kind;
+  pid_t pgid;
+  int last; // Index of the last command's child, -1 if that command could not be started
+  int remaining;
+  int status;
+  struct job* prev;
+  struct job* next;
+  int num_children;
+  struct child children[];
+};
+
+// Input read in blocks and handed out a line at a time
+struct line_reader {
+  int fd;
+  int pollable; // Whether fd can be waited for with epoll, which regular files cannot
+  int eof;
+  char* buf;
+  size_t start;
+  size_t len;
+  size_t cap;
+};
+
+// A reaped background child, kept so a later wait can still collect its status
+struct finished_job {
+  pid_t pid;
+  int status;
+};
+
+// What one command cost, as recorded in accounting mode
+struct acct_record {
+  pid_t pid;
+  int status;
+  int64_t wall_ns;
+  int64_t spawn_ns;
+  struct timeval user;
+  struct timeval sys;
+  long max_rss; // KiB
+  char command[32];
+};
+
+// A line of a script, tokenized and split into commands before the script runs. The
+// words keep their parameters, which are expanded each time the line runs
+struct script_line {
+  struct command* cmds;
+  int num_cmds;
+  int run_in_background;
+  char** words;  // The argv arrays of the commands, one after another
+  int words_len; // Entries in words, counting the NULL ending each argv
+  int expand;    // Whether any word or file name holds a parameter
+};
+
 // Global variables
 int last_exit_status = 0;
 pid_t last_bg_pid = -1;
-char* input_redirection_file = NULL;
-char* output_redirection_file = NULL;
 pid_t foreground_pid = -1;
+pid_t foreground_pgid = -1;
 int is_reading_input = 0;
+int is_interactive = 0;
+struct arena line_arena;
+struct arena script_arena; // The words of a script, kept while it runs
+const char* script_name = NULL;
+int script_line_number = 0; // Non-zero while a script is being parsed
+struct hash_entry* command_hash[HASH_BUCKETS];
+char* hashed_path = NULL; // The PATH the entries in command_hash were found with
+struct job* jobs = NULL;
+struct job* foreground_job = NULL;
+struct line_reader input;
+int event_fd = -1;   // epoll instance for child and input events
+int sigchld_fd = -1; // signalfd for SIGCHLD, which stays blocked in the shell
+int use_pidfds = 1;  // Cleared if a pidfd cannot be opened
+int parallel_limit = 0; // 0 outside a parallel block
+int parallel_running = 0;
+int parallel_failed = 0;
+struct finished_job finished_jobs[FINISHED_JOBS];
+int num_finished = 0;
+int acct_enabled = 0; // Set by SMALLSH_ACCT or SMALLSH_ACCT_LOG
+int acct_log_fd = -1;
+struct acct_record acct_history[ACCT_HISTORY];
+int num_acct = 0;
 
 // Function prototypes
 void background_processes();
-void wordsplit(const char* line, char* words[], int* num_words);
-void expand(char* words[], int num_words);
-int parse_and_execute(char* words[], int num_words,const char* line);
+void events_init(void);
+void acct_init(void);
+int wait_events(int timeout);
+char* read_line(struct line_reader* in);
+void run_parallel(struct command cmds[], int num_cmds);
+void arena_reset(struct arena* arena);
+void arena_put(struct arena* arena, const char* s, size_t n);
+char* arena_finish(struct arena* arena);
+void* arena_alloc(struct arena* arena, size_t n);
+void wordsplit(struct arena* arena, const char* line, char* words[], int* num_words);
+void expand(struct arena* arena, char* words[], int num_words);
+int parse_and_execute(char* words[], int num_words);
+int parse_pipeline(char* words[], int num_words, struct command cmds[]);
+void run_commands(struct command cmds[], int num_cmds, int run_in_background);
+static int redirect_builtin(const struct command* cmd, int saved[2]);
+static void restore_fds(int saved[2]);
+static int run_external(char* argv[]);
+struct script_line* load_script(const char* path, int* num_lines);
+void run_script_line(const struct script_line* line);
+int run_bench(int count);
+int execute_pipeline(struct command cmds[], int num_cmds, enum job_kind kind);
+const struct builtin* find_builtin(const char* name);
 void sigint_handler(int sig);
 
 int main(int argc, char *argv[]) {
-  FILE* input_stream = stdin;
-  if (argc > 1) {
-    input_stream = fopen(argv[1], "r");
-    if (!input_stream) {
-      perror("Error opening file");
+  // A script is read and parsed in full before any of it runs
+  struct script_line* script = NULL;
+  int num_lines = 0;
+  int bench_count = 0;
+  if (argc > 1 && strcmp(argv[1], "-B") == 0) {
+    bench_count = argc > 2 ? atoi(argv[2]) : 1000;
+    if (bench_count <= 0) {
+      fprintf(stderr, "Usage: %s -B [COMMANDS]\n", argv[0]);
       return 1;
     }
+  } else if (argc > 1) {
+    script = load_script(argv[1], &num_lines);
+    if (script == NULL) {
+      return errno ? 1 : 2;
+    }
   }
 
   // Signal Handling for SIGINT
@@ -52,320 +240,2053 @@ int main(int argc, char *argv[]) {
   sigint_action.sa_handler = sigint_handler;
   sigaction(SIGINT, &sigint_action, NULL);
 
-  char* line = NULL;
-  size_t len = 0;
-  ssize_t read;
-  char* words[MAX_WORDS];
+  // Interactive sessions hand the terminal to each foreground pipeline. Taking it back
+  // from a background process group raises SIGTTOU, so ignore that
+  is_interactive = script == NULL && isatty(STDIN_FILENO);
+  if (is_interactive) {
+    signal(SIGTTOU, SIG_IGN);
+  }
+
+  events_init();
+  acct_init();
+  if (bench_count > 0) {
+    return run_bench(bench_count);
+  }
+
+  for (int i = 0; i < num_lines; i++) {
+    background_processes();
+    run_script_line(&script[i]);
+  }
+
+  // The input is registered disarmed and armed by read_line() while it waits for a line
+  input.fd = STDIN_FILENO;
+  struct epoll_event input_event = {.events = EPOLLONESHOT, .data.ptr = &input};
+  input.pollable = epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &input_event) == 0;
+
+  char* words[MAX_WORDS + 1];
   int num_words;
 
-  for (;;){
+  while (script == NULL) {
     background_processes();
     // Command prompt setup
     char *PS1 = getenv("PS1");
     PS1 = PS1 ? PS1 : "$ ";
-    if (input_stream == stdin) {
-      fputs(PS1, stderr);
-    }
+    fputs(PS1, stderr);
     // Read input and handle comments
     is_reading_input = 1;
-    read = getline(&line, &len, input_stream);
+    char* line = read_line(&input);
     is_reading_input = 0;
+    if (line == NULL) {
+      break;
+    }
     char *commentPos = strchr(line, '#');
     if (commentPos) {
       *commentPos = '\0';
     }
-    if (read <= 0) {
-      if (errno == EINTR) continue;
-        break;
-    }
-    wordsplit(line, words, &num_words);
-    expand(words, num_words);
-    parse_and_execute(words, num_words, line);
+    arena_reset(&line_arena);
+    wordsplit(&line_arena, line, words, &num_words);
+    expand(&line_arena, words, num_words);
+    parse_and_execute(words, num_words);
+  }
+
+  if (parallel_limit > 0) {
+    // Still collect the jobs of a parallel block the input left open
+    fprintf(stderr, "smallsh: parallel: missing end\n");
+    char* end_argv[] = {"end", NULL};
+    last_exit_status = find_builtin("end")->run(end_argv);
   }
 
-  free(line);
-  if (input_stream != stdin) fclose(input_stream);
+  free(input.buf);
   return 0;
 }
 
+// background_processes() - Handle the children that have changed state since the last
+// look, without waiting for any. With no jobs there is nothing to look for.
 void background_processes() {
-  int status;
-  pid_t pid;
-  // Checking and reporting exit status of background processes
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
+  while (jobs && wait_events(0) != -1) {
+  }
+}
+
+// exit_status() - The $? value for a wait status.
+static int exit_status(int status) {
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// now_ns() - Monotonic time in nanoseconds.
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ms() - A timeval in milliseconds.
+static double ms(struct timeval tv) {
+  return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+// acct_init() - Turn on accounting if SMALLSH_ACCT or SMALLSH_ACCT_LOG is set. The log
+// is opened for appending, so several shells can share one.
+void acct_init(void) {
+  const char* log = getenv("SMALLSH_ACCT_LOG");
+  acct_enabled = getenv("SMALLSH_ACCT") != NULL || log != NULL;
+  if (log && *log) {
+    acct_log_fd = open(log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (acct_log_fd == -1) {
+      fprintf(stderr, "smallsh: %s: %s\n", log, strerror(errno));
+    }
+  }
+}
+
+// acct_record() - Record what a reaped child cost in the history for times, and append a
+// line for it to the log. Each line goes out in one write, so lines from shells sharing
+// the log do not interleave.
+static void acct_record(const struct child* child, int status, const struct rusage* usage) {
+  struct acct_record* record = &acct_history[num_acct++ % ACCT_HISTORY];
+  record->pid = child->pid;
+  record->status = status;
+  record->wall_ns = now_ns() - child->start_ns;
+  record->spawn_ns = child->spawn_ns;
+  record->user = usage->ru_utime;
+  record->sys = usage->ru_stime;
+  record->max_rss = usage->ru_maxrss;
+  memcpy(record->command, child->command, sizeof record->command);
+  if (acct_log_fd == -1) {
+    return;
+  }
+  struct timespec end;
+  clock_gettime(CLOCK_REALTIME, &end);
+  char line[256];
+  int len = snprintf(line, sizeof line, "%jd.%03ld\t%jd\t%d\t%.3f\t%.3f\t%.3f\t%ld\t%.1f\t%s\n",
+                     (intmax_t)end.tv_sec, end.tv_nsec / 1000000, (intmax_t)record->pid,
+                     record->status, record->wall_ns / 1e6, ms(record->user), ms(record->sys),
+                     record->max_rss, record->spawn_ns / 1e3, record->command);
+  if (write(acct_log_fd, line, len < (int)sizeof line ? len : (int)sizeof line - 1) == -1) {
+    perror("smallsh: accounting log");
+  }
+}
+
+// events_init() - Set up the epoll instance the shell waits in. SIGCHLD is blocked and
+// read from a signalfd instead, which reports stopped children, and exits as well when
+// there are no pidfds.
+void events_init(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  event_fd = epoll_create1(EPOLL_CLOEXEC);
+  sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (event_fd == -1 || sigchld_fd == -1) {
+    err(1, "event setup");
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &sigchld_fd};
+  epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &event);
+}
+
+// events_forget() - In a forked child, drop the jobs of the shell, which only the shell
+// can reap, and the epoll instance and signalfd it shares with it, then start afresh. A
+// builtin like wait there then only sees children of its own.
+static void events_forget(void) {
+  for (struct job* job = jobs; job; job = job->next) {
+    for (int i = 0; i < job->num_children; i++) {
+      if (job->children[i].pidfd != -1) {
+        close(job->children[i].pidfd);
+      }
+    }
+  }
+  jobs = NULL;
+  foreground_job = NULL;
+  num_finished = 0;
+  parallel_limit = 0;
+  parallel_running = 0;
+  parallel_failed = 0;
+  close(event_fd);
+  close(sigchld_fd);
+  events_init();
+}
+
+// watch_child() - Open a pidfd for a new child and add it to the epoll set. The first
+// failure switches every child over to being reaped on SIGCHLD.
+static void watch_child(struct child* child) {
+  child->pidfd = -1;
+  if (!use_pidfds) {
+    return;
+  }
+#ifdef SYS_pidfd_open
+  child->pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+#endif
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = child};
+  if (child->pidfd != -1 && epoll_ctl(event_fd, EPOLL_CTL_ADD, child->pidfd, &event) == 0) {
+    return;
+  }
+  if (child->pidfd != -1) {
+    close(child->pidfd);
+    child->pidfd = -1;
+  }
+  use_pidfds = 0;
+  for (struct job* job = jobs; job; job = job->next) {
+    for (int i = 0; i < job->num_children; i++) {
+      if (job->children[i].pidfd != -1) {
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, job->children[i].pidfd, NULL);
+        close(job->children[i].pidfd);
+        job->children[i].pidfd = -1;
+      }
+    }
+  }
+}
+
+// find_child() - The unreaped child with the given pid, or NULL.
+static struct child* find_child(pid_t pid) {
+  for (struct job* job = jobs; job; job = job->next) {
+    for (int i = 0; i < job->num_children; i++) {
+      if (job->children[i].pid == pid) {
+        return &job->children[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+// link_job() - Add a job to the front of the jobs list.
+static void link_job(struct job* job) {
+  job->prev = NULL;
+  job->next = jobs;
+  if (jobs) {
+    jobs->prev = job;
+  }
+  jobs = job;
+}
+
+// unlink_job() - Take a job out of the jobs list and free it.
+static void unlink_job(struct job* job) {
+  if (job->prev) {
+    job->prev->next = job->next;
+  } else {
+    jobs = job->next;
+  }
+  if (job->next) {
+    job->next->prev = job->prev;
+  }
+  free(job);
+}
+
+// job_done() - Finish a job whose processes have all been reaped and drop it from the
+// jobs list. A foreground job sets $?, and a parallel job frees its slot.
+static void job_done(struct job* job) {
+  if (job == foreground_job) {
+    last_exit_status = job->status;
+    foreground_job = NULL;
+  } else if (job->kind == JOB_PARALLEL) {
+    parallel_running--;
+    if (job->status != 0) {
+      parallel_failed++;
+    }
+  }
+  unlink_job(job);
+}
+
+// child_exited() - Account for a reaped child. Background children are reported, every
+// child outside the foreground is remembered for wait, and in accounting mode what it
+// cost is recorded.
+static void child_exited(struct child* child, int status, const struct rusage* usage) {
+  struct job* job = child->job;
+  if (child->pidfd != -1) {
+    // A command being spawned can briefly hold a copy of the pidfd, which would keep it
+    // in the epoll set after close, so remove it first
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, child->pidfd, NULL);
+    close(child->pidfd);
+    child->pidfd = -1;
+  }
+  if (child - job->children == job->last) {
+    job->status = exit_status(status);
+  }
+  if (acct_enabled) {
+    acct_record(child, exit_status(status), usage);
+  }
+  if (job->kind == JOB_BACKGROUND) {
     if (WIFEXITED(status)) {
-      fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t)pid, WEXITSTATUS(status));
+      fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t)child->pid, WEXITSTATUS(status));
     } else if (WIFSIGNALED(status)) {
-      fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t)pid, WTERMSIG(status));
-    } else if (WIFSTOPPED(status)) {
-      if (pid == foreground_pid) {
-        printf("%jd\n", (intmax_t)pid);
-        foreground_pid = -1;
-      } else {
-      kill(pid, SIGCONT);
-      fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t)pid);
+      fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t)child->pid, WTERMSIG(status));
+    }
+  }
+  if (job != foreground_job) {
+    finished_jobs[num_finished % FINISHED_JOBS] = (struct finished_job){child->pid, exit_status(status)};
+    num_finished++;
+  }
+  child->pid = -1;
+  if (--job->remaining == 0) {
+    job_done(job);
+  }
+}
+
+// child_stopped() - Continue a child stopped by signal sig. A foreground pipeline that
+// touched the terminal before it was handed over just carries on; one stopped otherwise
+// carries on in the background. Parallel jobs are continued quietly. A job outside the
+// foreground that tried to use the terminal would only stop again, so it stays stopped.
+static void child_stopped(struct child* child, int sig) {
+  struct job* job = child->job;
+  if (job != foreground_job && (sig == SIGTTIN || sig == SIGTTOU)) {
+    fprintf(stderr, "Child process %jd stopped. Signaled %d.\n", (intmax_t)child->pid, sig);
+    return;
+  }
+  if (job->kind == JOB_PARALLEL) {
+    kill(child->pid, SIGCONT);
+    return;
+  }
+  if (job == foreground_job && (sig == SIGTTIN || sig == SIGTTOU)) {
+    kill(-job->pgid, SIGCONT);
+    return;
+  }
+  if (job == foreground_job) {
+    kill(-job->pgid, SIGCONT);
+    job->kind = JOB_BACKGROUND;
+    foreground_job = NULL;
+    if (job->last != -1) {
+      last_bg_pid = job->children[job->last].pid;
+    }
+  } else {
+    kill(child->pid, SIGCONT);
+  }
+  fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t)child->pid);
+}
+
+// reap_signalled() - Handle a SIGCHLD from the signalfd. With pidfds only stopped
+// children are collected here, since exits arrive on the pidfds; otherwise every
+// changed child is.
+static void reap_signalled(void) {
+  struct signalfd_siginfo signal_info;
+  while (read(sigchld_fd, &signal_info, sizeof signal_info) > 0) {
+  }
+  if (!use_pidfds) {
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+      struct child* child = find_child(pid);
+      if (child && WIFSTOPPED(status)) {
+        child_stopped(child, WSTOPSIG(status));
+      } else if (child) {
+        child_exited(child, status, &usage);
       }
     }
+    return;
+  }
+  for (;;) {
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) == -1 || info.si_pid == 0) {
+      break;
+    }
+    struct child* child = find_child(info.si_pid);
+    if (child) {
+      child_stopped(child, info.si_status);
+    }
   }
 }
 
-// wordsplit() - Split the input line into individual words.
-void wordsplit(const char* line, char* words[], int* num_words) {
-  char *token, *temp_line, *cursor;
-  temp_line = strdup(line); // Duplicate the line to avoid modifying the original
-  *num_words = 0;
-  cursor = temp_line;
-  while (*cursor && *num_words < MAX_WORDS) {
-    while (*cursor == ' ' || *cursor == '\n') {
-      cursor++; // Skip spaces and newlines
+// wait_events() - Wait up to timeout milliseconds, or without limit for -1, and handle
+// the children that exited or stopped. Returns 1 if the input became readable, 0 if
+// only other events came, and -1 if nothing did.
+int wait_events(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(event_fd, events, MAX_EVENTS, timeout);
+  if (n <= 0) {
+    return n == -1 && errno == EINTR ? 0 : -1;
+  }
+  int input_ready = 0;
+  for (int i = 0; i < n; i++) {
+    void* source = events[i].data.ptr;
+    if (source == &input) {
+      input_ready = 1;
+    } else if (source == &sigchld_fd) {
+      reap_signalled();
+    } else if (use_pidfds) {
+      struct child* child = source;
+      int status;
+      struct rusage usage;
+      if (child->pid > 0 && wait4(child->pid, &status, WNOHANG, &usage) > 0) {
+        child_exited(child, status, &usage);
+      }
     }
-    token = cursor;  
-    while (*cursor && *cursor != ' ' && *cursor != '\n') {
-      if (*cursor == '\\') {
-        // Instead of skipping, we'll handle the escape sequences
-        memmove(cursor, cursor+1, strlen(cursor)); // Shift everything one position to the left
-        cursor++;
-      } else {
-        cursor++;
+  }
+  return input_ready;
+}
+
+// read_line() - Return the next line of input without its newline, or NULL at the end.
+// The line stays valid until the next call. Children are handled as they change state
+// while waiting for input that can be polled.
+char* read_line(struct line_reader* in) {
+  for (;;) {
+    char* line = in->buf + in->start;
+    char* newline = in->len > in->start ? memchr(line, '\n', in->len - in->start) : NULL;
+    if (newline) {
+      *newline = '\0';
+      in->start = newline + 1 - in->buf;
+      return line;
+    }
+    if (in->eof) {
+      if (in->start == in->len) {
+        return NULL;
       }
+      in->buf[in->len] = '\0'; // A last line without a newline
+      in->start = in->len;
+      return line;
     }
-    if (token != cursor) {
-      words[*num_words] = strndup(token, cursor - token);
-      (*num_words)++;
+    // Keep the partial line at the front and make room for a block after it
+    memmove(in->buf, line, in->len - in->start);
+    in->len -= in->start;
+    in->start = 0;
+    if (in->cap - in->len < INPUT_BLOCK / 2) {
+      in->cap = in->cap ? 2 * in->cap : INPUT_BLOCK;
+      in->buf = realloc(in->buf, in->cap);
+      if (in->buf == NULL) {
+        err(1, "realloc");
+      }
+    }
+    if (in->pollable) {
+      struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = in};
+      epoll_ctl(event_fd, EPOLL_CTL_MOD, in->fd, &event);
+      while (wait_events(-1) == 0) {
+      }
+    }
+    ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len - 1);
+    if (n > 0) {
+      in->len += n;
+    } else if (n == 0 || errno != EINTR) {
+      in->eof = 1;
     }
   }
-  words[*num_words] = NULL; // Ensure NULL-termination
-  // Detect and handle the '<' operator for input redirection here
-  for (int i = 0; i < *num_words; i++) {
-    if (strcmp(words[i], "<") == 0) {
-      // Check if there is a word after '<'
-      if (i + 1 < *num_words) {
-        input_redirection_file = strdup(words[i+1]);
-        // Remove < and filename from the words array
-        free(words[i]);
-        free(words[i+1]);
-        for (int j = i; j < *num_words - 2; j++) {
-          words[j] = words[j+2];
-        }
-        words[*num_words - 1] = NULL;
-        words[*num_words - 2] = NULL;
-        *num_words -= 2;
+}
+
+// arena_reset() - Drop every word in the arena, keeping its blocks for the next line.
+void arena_reset(struct arena* arena) {
+  arena->block = arena->first;
+  arena->used = 0;
+  arena->len = 0;
+}
+
+// arena_reserve() - Make room for n more bytes after the word being built and return
+// where they go. When the block is full the word so far moves to the next block, or to a
+// new one if that is too small.
+static char* arena_reserve(struct arena* arena, size_t n) {
+  struct arena_block* block = arena->block;
+  if (block == NULL || arena->used + arena->len + n > block->size) {
+    size_t need = arena->len + n;
+    struct arena_block* next = block ? block->next : arena->first;
+    if (next == NULL || next->size < need) {
+      size_t size = need > ARENA_BLOCK / 2 ? 2 * need : ARENA_BLOCK;
+      struct arena_block* fresh = malloc(sizeof *fresh + size);
+      if (fresh == NULL) {
+        err(1, "malloc");
+      }
+      fresh->size = size;
+      fresh->next = next;
+      if (block) {
+        block->next = fresh;
+      } else {
+        arena->first = fresh;
       }
+      next = fresh;
+    }
+    if (block) {
+      memcpy(next->data, block->data + arena->used, arena->len);
+    }
+    arena->block = block = next;
+    arena->used = 0;
+  }
+  return block->data + arena->used + arena->len;
+}
+
+// arena_put() - Add n bytes to the word being built.
+void arena_put(struct arena* arena, const char* s, size_t n) {
+  memcpy(arena_reserve(arena, n), s, n);
+  arena->len += n;
+}
+
+// arena_alloc() - Room for n bytes aligned for pointers, between words.
+void* arena_alloc(struct arena* arena, size_t n) {
+  arena->used = (arena->used + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  void* p = arena_reserve(arena, n);
+  arena->used += n;
+  return p;
+}
+
+// arena_finish() - Terminate the word being built and return it.
+char* arena_finish(struct arena* arena) {
+  arena_put(arena, "", 1);
+  char* word = arena->block->data + arena->used;
+  arena->used += arena->len;
+  arena->len = 0;
+  return word;
+}
+
+// wordsplit() - Split the input line into individual words, in one pass over the line.
+// A backslash makes the next character literal. Unescaped $$, $?, $! and ${NAME} are
+// left for expand() as a PARAM byte and the rest of the parameter.
+void wordsplit(struct arena* arena, const char* line, char* words[], int* num_words) {
+  static const char special[] = {' ', '\n', '\\', '$', PARAM, '\0'};
+  const char* cursor = line;
+  *num_words = 0;
+  for (;;) {
+    while (*cursor == ' ' || *cursor == '\n') {
+      cursor++; // Skip spaces and newlines
+    }
+    if (*cursor == '\0' || *num_words == MAX_WORDS) {
       break;
     }
-    for (int i = 0; i < *num_words; i++) {
-      if (strcmp(words[i], ">>") == 0) {
-        // Check if there is a word after '>>'
-        if (i + 1 < *num_words) {
-          output_redirection_file = strdup(words[i+1]);
-          // Remove >> and filename from the words array
-          free(words[i]);
-          free(words[i+1]);
-          for (int j = i; j < *num_words - 2; j++) {
-            words[j] = words[j+2];
+    while (*cursor && *cursor != ' ' && *cursor != '\n') {
+      size_t plain = strcspn(cursor, special);
+      if (plain > 0) {
+        arena_put(arena, cursor, plain);
+        cursor += plain;
+      } else if (*cursor == '\\') {
+        if (cursor[1] == '\0') {
+          cursor++;
+        } else {
+          if (cursor[1] == PARAM) {
+            arena_put(arena, cursor + 1, 1);
           }
-          words[*num_words - 1] = NULL;
-          words[*num_words - 2] = NULL;
-          *num_words -= 2;
+          arena_put(arena, cursor + 1, 1);
+          cursor += 2;
         }
-        break;
-      }
-    }
-  }
-  for (int i = 0; i < *num_words; i++) {
-    if (strcmp(words[i], ">") == 0) {
-      // Check if there is a word after '>'
-      if (i + 1 < *num_words) {
-        output_redirection_file = strdup(words[i+1]);
-        // Remove > and filename from the words array
-        free(words[i]);
-        free(words[i+1]);
-        for (int j = i; j < *num_words - 2; j++) {
-          words[j] = words[j+2];
+      } else if (*cursor == PARAM) {
+        arena_put(arena, "\x01\x01", 2);
+        cursor++;
+      } else if (cursor[1] == '$' || cursor[1] == '?' || cursor[1] == '!') {
+        arena_put(arena, "\x01", 1);
+        arena_put(arena, cursor + 1, 1);
+        cursor += 2;
+      } else {
+        // ${NAME} with the closing brace in the same word, otherwise a plain '$'
+        size_t name = cursor[1] == '{' ? strcspn(cursor + 2, "} \n") : 0;
+        if (cursor[1] == '{' && cursor[2 + name] == '}') {
+          arena_put(arena, "\x01", 1);
+          arena_put(arena, cursor + 1, name + 2);
+          cursor += name + 3;
+        } else {
+          arena_put(arena, cursor, 1);
+          cursor++;
         }
-        words[*num_words - 1] = NULL;
-        words[*num_words - 2] = NULL;
-        *num_words -= 2;
       }
-      break;
     }
+    words[(*num_words)++] = arena_finish(arena);
   }
-  free(temp_line);
+  words[*num_words] = NULL; // Ensure NULL-termination
 }
 
-// expand() - Handle parameter expansion.
-void expand(char* words[], int num_words) {
-  char pid_str[20];  // to store pid as string
-  char exit_str[20]; // to store last exit status as string
-  char last_bg_pid_str[20]; // to store last background pid as string
-  sprintf(pid_str, "%d", getpid());
-  sprintf(exit_str, "%d", last_exit_status);
-  sprintf(last_bg_pid_str, "%d", last_bg_pid);
+// expand() - Handle parameter expansion. NULL entries are skipped. Each word holding a PARAM byte is rewritten into
+// the arena in one pass, replacing $$ with the shell's pid, $? with the last exit status,
+// $! with the last background pid and ${NAME} with the environment variable, or nothing
+// if it is unset.
+void expand(struct arena* arena, char* words[], int num_words) {
+  char value[24];
   for (int i = 0; i < num_words; i++) {
-    if (strstr(words[i], "$$")) {
-      char *expanded_word = (char *)malloc(MAX_LINE_LENGTH);
-      char *token = strstr(words[i], "$$");
-      strncpy(expanded_word, words[i], token - words[i]);
-      strcat(expanded_word, pid_str);
-      strcat(expanded_word, token + 2);
-      free(words[i]);
-      words[i] = expanded_word;
-    } else if (strstr(words[i], "$?")) {
-      char *expanded_word = (char *)malloc(MAX_LINE_LENGTH);
-      char *token = strstr(words[i], "$?");
-      strncpy(expanded_word, words[i], token - words[i]);
-      strcat(expanded_word, exit_str);
-      strcat(expanded_word, token + 2);
-      free(words[i]);
-      words[i] = expanded_word;
-    }else if (strstr(words[i], "$!")) {
-      char *expanded_word = (char *)malloc(MAX_LINE_LENGTH);
-      char *token = strstr(words[i], "$!");
-      strncpy(expanded_word, words[i], token - words[i]);
-      strcat(expanded_word, last_bg_pid_str);
-      strcat(expanded_word, token + 2);
-      free(words[i]);
-      words[i] = expanded_word;
-    }else if (strstr(words[i], "$!")) {
-      char *expanded_word = (char *)malloc(MAX_LINE_LENGTH);
-      char *token = strstr(words[i], "$!");
-      strncpy(expanded_word, words[i], token - words[i]);
-      strcat(expanded_word, last_bg_pid_str); 
-      strcat(expanded_word, token + 2);
-      free(words[i]);
-      words[i] = expanded_word;
-    }
-    for (int i = 0; i < num_words; i++) {
-    // Check for patterns 
-      if (words[i][0] == '$' && words[i][1] == '{') {
-        char *end_brace = strchr(words[i], '}');
-        if (end_brace) {
-          *end_brace = '\0';  // Null terminate at the closing brace
-          char *var_name = &words[i][2];  // Skip past ${ to get the variable name
-          char *env_value = getenv(var_name);  // Get the environment variable's value
+    const char* p = words[i] ? strchr(words[i], PARAM) : NULL;
+    if (p == NULL) {
+      continue;
+    }
+    const char* word = words[i];
+    arena_put(arena, word, p - word);
+    while (p) {
+      const char* rest = p + 2;
+      switch (p[1]) {
+        case '$':
+          arena_put(arena, value, sprintf(value, "%jd", (intmax_t)getpid()));
+          break;
+        case '?':
+          arena_put(arena, value, sprintf(value, "%d", last_exit_status));
+          break;
+        case '!':
+          arena_put(arena, value, sprintf(value, "%jd", (intmax_t)last_bg_pid));
+          break;
+        case '{': {
+          const char* end = strchr(p + 2, '}');
+          char name[end - p - 1];
+          memcpy(name, p + 2, end - p - 2);
+          name[end - p - 2] = '\0';
+          const char* env_value = getenv(name);
           if (env_value) {
-            free(words[i]);
-            words[i] = strdup(env_value);  // Replace the word with the environment variable's value
-          } else {
-            free(words[i]);
-            words[i] = strdup("");  // If the environment variable isn't set, replace with an empty string
+            arena_put(arena, env_value, strlen(env_value));
           }
+          rest = end + 1;
+          break;
         }
+        default:
+          arena_put(arena, p + 1, 1); // A literal PARAM byte
+          break;
       }
+      p = strchr(rest, PARAM);
+      arena_put(arena, rest, p ? (size_t)(p - rest) : strlen(rest));
     }
+    words[i] = arena_finish(arena);
   }
 }
 
 // parse_and_execute() - Parse the list of words and execute them as commands.
-int parse_and_execute(char* words[], int num_words, const char* line) {
+int parse_and_execute(char* words[], int num_words) {
   if (num_words == 0) {
     return 0; 
   }
   int run_in_background = 0;
   if (strcmp(words[num_words - 1], "&") == 0) {
     run_in_background = 1;
-    free(words[num_words - 1]);
     words[num_words - 1] = NULL;
     num_words--;
   }
-  // CD command
-  if (strcmp(words[0], "cd") == 0) {
-    if (num_words == 1) { // cd with no arguments goes to the home directory
-      chdir(getenv("HOME"));
-    } else { // Otherwise, go to the directory specified
-      if(chdir(words[1]) != 0) {
-        perror("smallsh");
-      }
+  // Actual execution
+  struct command cmds[MAX_PIPELINE];
+  int num_cmds = parse_pipeline(words, num_words, cmds);
+  if (num_cmds > 0) {
+    run_commands(cmds, num_cmds, run_in_background);
+  }
+  return 0;
+}
+
+// run_commands() - Run a parsed pipeline: a lone builtin in the shell, a pipeline in a
+// parallel block as one of its jobs, and anything else as a job of its own.
+void run_commands(struct command cmds[], int num_cmds, int run_in_background) {
+  const struct builtin* builtin = num_cmds == 1 ? find_builtin(cmds[0].argv[0]) : NULL;
+  if (builtin && !run_in_background) {
+    // A builtin on its own runs in the shell, so cd and exit affect the shell itself and
+    // the rest need no fork. Its redirections last only as long as it runs
+    int saved[2] = {-1, -1};
+    int in_block = parallel_limit > 0;
+    if (redirect_builtin(&cmds[0], saved) == 0) {
+      last_exit_status = builtin->run(cmds[0].argv);
+    } else {
+      last_exit_status = 1;
     }
-    if (strcmp(words[0], "cd") == 0) {
-      for (int i = 0; i < num_words; i++) {
-        free(words[i]);
-      }
-      return 0; // Only return after handling cd command
-    }
-  }
-  // Exit command
-  if (strcmp(words[0], "exit") == 0) {
-    int exit_status = 0; // default exit status
-    if (num_words > 1) {
-      exit_status = atoi(words[1]);
-      if(exit_status == 0 && strcmp(words[1], "0") != 0) {
-        // Handle invalid integer. For now, we'll just print an error
-        fprintf(stderr, "smallsh: exit: %s: numeric argument required\n", words[1]);
-        exit_status = 1;
-      }
+    fflush(stdout);
+    restore_fds(saved);
+    if (in_block && parallel_limit > 0 && last_exit_status != 0) {
+      parallel_failed++; // Counted like any other job of the block
+    }
+  } else if (parallel_limit > 0 && !run_in_background) {
+    run_parallel(cmds, num_cmds);
+  } else {
+    execute_pipeline(cmds, num_cmds, run_in_background ? JOB_BACKGROUND : JOB_FOREGROUND);
+  }
+}
+
+// load_script() - Read a script in one go and parse every line of it into the script
+// arena, so that running it needs no further reading or splitting. Each syntax error is
+// reported with its line, and if there are any NULL is returned with errno 0 and nothing
+// runs. NULL with errno set means the file could not be read.
+struct script_line* load_script(const char* path, int* num_lines) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("Error opening file");
+    return NULL;
+  }
+  struct stat st;
+  size_t cap = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (size_t)st.st_size + 1 : INPUT_BLOCK;
+  size_t len = 0;
+  char* text = malloc(cap);
+  for (;;) {
+    if (text && len + 1 == cap) {
+      cap *= 2;
+      text = realloc(text, cap);
     }
-    for (int i = 0; i < num_words; i++) {
-      free(words[i]);
+    if (text == NULL) {
+      err(1, "malloc");
+    }
+    ssize_t n = read(fd, text + len, cap - len - 1);
+    if (n > 0) {
+      len += n;
+    } else if (n == 0) {
+      break;
+    } else if (errno != EINTR) {
+      perror("Error reading file");
+      close(fd);
+      free(text);
+      return NULL;
     }
-    exit(exit_status);
   }
-  // Actual execution
-  pid_t pid = fork();
-  if (pid == 0) {
-    signal(SIGTSTP, SIG_DFL);  
-    signal(SIGCONT, SIG_DFL);
-    // Child process
-    if (input_redirection_file) { 
-      int in_fd = open(input_redirection_file, O_RDONLY);
-      if (in_fd == -1) {
-        perror("smallsh");
-        exit(EXIT_FAILURE);
-      }
-      dup2(in_fd, STDIN_FILENO);
-      close(in_fd);
-      free(input_redirection_file);
-      input_redirection_file = NULL; // Reset for next command
+  close(fd);
+  text[len] = '\0';
+
+  int lines_cap = 256;
+  struct script_line* lines = malloc(lines_cap * sizeof *lines);
+  int errors = 0;
+  char* words[MAX_WORDS + 1];
+  int num_words;
+  struct command cmds[MAX_PIPELINE];
+  script_name = path;
+  *num_lines = 0;
+  for (char* line = text; line < text + len; line++) {
+    char* newline = memchr(line, '\n', text + len - line);
+    newline = newline ? newline : text + len;
+    *newline = '\0';
+    script_line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
     }
-    if (output_redirection_file) {
-      int out_fd;
-      if (strstr(line, ">>")) {
-        out_fd = open(output_redirection_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-      } else {
-        out_fd = open(output_redirection_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      }
-      if (out_fd == -1) {
-        perror("smallsh");
-        exit(EXIT_FAILURE);
-      }
-      dup2(out_fd, STDOUT_FILENO);
-      close(out_fd);
-      free(output_redirection_file);
-      output_redirection_file = NULL;
+    wordsplit(&script_arena, line, words, &num_words);
+    line = newline;
+    if (num_words == 0) {
+      continue;
     }
-    signal(SIGTSTP, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    execvp(words[0], words);
+    int run_in_background = 0;
+    if (strcmp(words[num_words - 1], "&") == 0) {
+      run_in_background = 1;
+      words[--num_words] = NULL;
+    }
+    int num_cmds = parse_pipeline(words, num_words, cmds);
+    if (num_cmds < 0) {
+      errors++;
+      continue;
+    }
+    if (lines && *num_lines == lines_cap) {
+      lines_cap *= 2;
+      lines = realloc(lines, lines_cap * sizeof *lines);
+    }
+    if (lines == NULL) {
+      err(1, "malloc");
+    }
+    // Move the argv arrays and commands out of the scratch arrays
+    struct script_line* parsed = &lines[(*num_lines)++];
+    char** end = cmds[num_cmds - 1].argv;
+    while (*end) {
+      end++;
+    }
+    parsed->words_len = end + 1 - words;
+    parsed->words = arena_alloc(&script_arena, parsed->words_len * sizeof *words);
+    memcpy(parsed->words, words, parsed->words_len * sizeof *words);
+    parsed->cmds = arena_alloc(&script_arena, num_cmds * sizeof *cmds);
+    parsed->num_cmds = num_cmds;
+    parsed->run_in_background = run_in_background;
+    parsed->expand = 0;
+    for (int i = 0; i < num_cmds; i++) {
+      parsed->cmds[i] = cmds[i];
+      parsed->cmds[i].argv = parsed->words + (cmds[i].argv - words);
+      parsed->expand |= (cmds[i].input_file && strchr(cmds[i].input_file, PARAM)) ||
+                        (cmds[i].output_file && strchr(cmds[i].output_file, PARAM));
+    }
+    for (int i = 0; i < parsed->words_len && !parsed->expand; i++) {
+      parsed->expand = words[i] && strchr(words[i], PARAM);
+    }
+  }
+  script_line_number = 0;
+  free(text);
+  if (errors > 0) {
+    free(lines);
+    errno = 0;
+    return NULL;
+  }
+  return lines;
+}
+
+// run_script_line() - Run a parsed script line. Lines without parameters run straight
+// from the parsed commands; others are expanded into copies in line_arena first.
+void run_script_line(const struct script_line* line) {
+  if (!line->expand) {
+    run_commands(line->cmds, line->num_cmds, line->run_in_background);
+    return;
+  }
+  char* words[MAX_WORDS + MAX_PIPELINE];
+  struct command cmds[MAX_PIPELINE];
+  arena_reset(&line_arena);
+  memcpy(words, line->words, line->words_len * sizeof *words);
+  expand(&line_arena, words, line->words_len);
+  for (int i = 0; i < line->num_cmds; i++) {
+    cmds[i] = line->cmds[i];
+    cmds[i].argv = words + (line->cmds[i].argv - line->words);
+    expand(&line_arena, &cmds[i].input_file, cmds[i].input_file != NULL);
+    expand(&line_arena, &cmds[i].output_file, cmds[i].output_file != NULL);
+  }
+  run_commands(cmds, line->num_cmds, line->run_in_background);
+}
+
+// builtin_cd() - Change the working directory, to HOME if no directory is given.
+static int builtin_cd(char* argv[]) {
+  const char* dir = argv[1] ? argv[1] : getenv("HOME");
+  if (dir == NULL || chdir(dir) != 0) {
     perror("smallsh");
-    exit(1);
-    } else if (pid < 0) {
-      perror("fork failed");
+    return 1;
+  }
+  return 0;
+}
+
+// builtin_exit() - Exit the shell with the given status, 0 by default.
+static int builtin_exit(char* argv[]) {
+  int exit_status = 0; // default exit status
+  if (argv[1]) {
+    exit_status = atoi(argv[1]);
+    if(exit_status == 0 && strcmp(argv[1], "0") != 0) {
+      // Handle invalid integer. For now, we'll just print an error
+      fprintf(stderr, "smallsh: exit: %s: numeric argument required\n", argv[1]);
+      exit_status = 1;
+    }
+  }
+  exit(exit_status);
+}
+
+// hash_bucket() - The command_hash chain a command name belongs in.
+static struct hash_entry** hash_bucket(const char* name) {
+  unsigned h = 5381;
+  for (const char* c = name; *c; c++) {
+    h = h * 33 + (unsigned char)*c;
+  }
+  return &command_hash[h % HASH_BUCKETS];
+}
+
+// hash_reset() - Forget every remembered command.
+static void hash_reset(void) {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    while (command_hash[i]) {
+      struct hash_entry* entry = command_hash[i];
+      command_hash[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
+
+// hash_forget() - Forget one command, used when its remembered path has gone away.
+static void hash_forget(const char* name) {
+  for (struct hash_entry** link = hash_bucket(name); *link; link = &(*link)->next) {
+    if (strcmp((*link)->name, name) == 0) {
+      struct hash_entry* entry = *link;
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+  }
+}
+
+// search_path() - Look for an executable file called name in each directory of PATH, an
+// empty entry meaning the current directory. Returns a malloc'd path or NULL.
+static char* search_path(const char* name, const char* path) {
+  size_t name_len = strlen(name);
+  while (path) {
+    const char* end = strchr(path, ':');
+    size_t dir_len = end ? (size_t)(end - path) : strlen(path);
+    char* file = malloc(dir_len + name_len + 2);
+    if (dir_len == 0) {
+      memcpy(file, name, name_len + 1);
     } else {
-      if (run_in_background) {
-        last_bg_pid = pid;
-      } else {
-        foreground_pid = pid;
-        int status;
-        waitpid(pid, &status, 0); // Wait for child process to terminate
-      if (WIFEXITED(status)) {
-        last_exit_status = WEXITSTATUS(status);
-      } else if (WIFSIGNALED(status)) {
-        last_exit_status = 128 + WTERMSIG(status);
-      }
-      foreground_pid = -1;
+      memcpy(file, path, dir_len);
+      file[dir_len] = '/';
+      memcpy(file + dir_len + 1, name, name_len + 1);
+    }
+    struct stat st;
+    if (stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0) {
+      return file;
     }
+    free(file);
+    path = end ? end + 1 : NULL;
   }
-  if (input_redirection_file) {
-    free(input_redirection_file);
-    input_redirection_file = NULL;
+  return NULL;
+}
+
+// hash_check_path() - Drop the whole of command_hash if PATH has changed since it was
+// filled. Returns the PATH to search.
+static const char* hash_check_path(void) {
+  const char* path = getenv("PATH");
+  if (path == NULL) {
+    path = "/usr/local/bin:/usr/bin:/bin";
   }
-  if (output_redirection_file) {
-    free(output_redirection_file);
-    output_redirection_file = NULL;
+  if (hashed_path == NULL || strcmp(hashed_path, path) != 0) {
+    hash_reset();
+    free(hashed_path);
+    hashed_path = strdup(path);
   }
-  for (int i = 0; i < num_words; i++) {
-    free(words[i]); // Free the dynamically allocated memory
+  return path;
+}
+
+// find_command() - Resolve a command name to the file to run. Names with a '/' are used
+// as they are; others come from command_hash, or from a PATH search that is then
+// remembered. Returns NULL if the command is not found.
+static const char* find_command(const char* name) {
+  if (strchr(name, '/')) {
+    return name;
+  }
+  const char* path = hash_check_path();
+  struct hash_entry** bucket = hash_bucket(name);
+  for (struct hash_entry* entry = *bucket; entry; entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      entry->hits++;
+      return entry->path;
+    }
+  }
+  char* file = search_path(name, path);
+  if (file == NULL) {
+    return NULL;
   }
+  struct hash_entry* entry = malloc(sizeof *entry);
+  entry->name = strdup(name);
+  entry->path = file;
+  entry->hits = 1;
+  entry->next = *bucket;
+  *bucket = entry;
+  return file;
+}
+
+// builtin_hash() - With no arguments list the remembered commands, with -r forget them
+// all, and otherwise look up each named command and remember it.
+static int builtin_hash(char* argv[]) {
+  if (argv[1] == NULL) {
+    int any = 0;
+    hash_check_path();
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+      for (struct hash_entry* entry = command_hash[i]; entry; entry = entry->next) {
+        if (!any) {
+          printf("hits\tcommand\n");
+          any = 1;
+        }
+        printf("%4u\t%s\n", entry->hits, entry->path);
+      }
+    }
+    if (!any) {
+      printf("hash: hash table empty\n");
+    }
+    fflush(stdout);
+    return 0;
+  }
+  if (strcmp(argv[1], "-r") == 0) {
+    hash_reset();
+    return 0;
+  }
+  int status = 0;
+  for (int i = 1; argv[i]; i++) {
+    if (strchr(argv[i], '/')) {
+      continue;
+    }
+    hash_forget(argv[i]);
+    if (find_command(argv[i]) == NULL) {
+      fprintf(stderr, "smallsh: hash: %s: not found\n", argv[i]);
+      status = 1;
+    } else {
+      // Looking it up here is not a use of the command
+      (*hash_bucket(argv[i]))->hits = 0;
+    }
+  }
+  return status;
+}
+
+// run_parallel() - Start a pipeline as a job of the parallel block, first waiting for a
+// job to finish if all of the slots are taken.
+void run_parallel(struct command cmds[], int num_cmds) {
+  while (parallel_running == parallel_limit) {
+    wait_events(-1);
+  }
+  if (execute_pipeline(cmds, num_cmds, JOB_PARALLEL) == 0) {
+    parallel_failed++;
+    return;
+  }
+  parallel_running++;
+}
+
+// builtin_parallel() - Start a parallel block: the pipelines up to the matching end run
+// as background jobs, at most N at a time (-j N, the number of online CPUs by default).
+static int builtin_parallel(char* argv[]) {
+  long limit = sysconf(_SC_NPROCESSORS_ONLN);
+  if (parallel_limit > 0) {
+    fprintf(stderr, "smallsh: parallel: already in a parallel block\n");
+    return 1;
+  }
+  if (argv[1] && strncmp(argv[1], "-j", 2) == 0) {
+    const char* count = argv[1][2] ? argv[1] + 2 : argv[2];
+    char* end;
+    limit = count ? strtol(count, &end, 10) : 0;
+    if (count == NULL || *end != '\0' || limit < 1) {
+      fprintf(stderr, "smallsh: parallel: -j needs a positive job count\n");
+      return 1;
+    }
+  } else if (argv[1]) {
+    fprintf(stderr, "smallsh: parallel: usage: parallel [-j N]\n");
+    return 1;
+  }
+  parallel_limit = limit;
+  parallel_running = 0;
+  parallel_failed = 0;
+  return 0;
+}
+
+// builtin_end() - Wait for every job of the parallel block and close it. The status is
+// the number of jobs that failed, at most 255.
+static int builtin_end(char* argv[]) {
+  (void)argv;
+  if (parallel_limit == 0) {
+    fprintf(stderr, "smallsh: end: not in a parallel block\n");
+    return 1;
+  }
+  while (parallel_running > 0) {
+    wait_events(-1);
+  }
+  parallel_limit = 0;
+  return parallel_failed > 255 ? 255 : parallel_failed;
+}
+
+// builtin_wait() - With no arguments wait for all children, including the jobs of a
+// parallel block. Otherwise wait for each pid and return the status of the last one.
+static int builtin_wait(char* argv[]) {
+  if (argv[1] == NULL) {
+    while (jobs) {
+      wait_events(-1);
+    }
+    return 0;
+  }
+  int result = 0;
+  for (int i = 1; argv[i]; i++) {
+    pid_t pid = atoi(argv[i]);
+    while (pid > 0 && find_child(pid)) {
+      wait_events(-1);
+    }
+    // Once reaped its status is among the finished jobs
+    result = 127;
+    for (int j = num_finished - 1; j >= 0 && j >= num_finished - FINISHED_JOBS; j--) {
+      if (finished_jobs[j % FINISHED_JOBS].pid == pid) {
+        result = finished_jobs[j % FINISHED_JOBS].status;
+        break;
+      }
+    }
+    if (result == 127) {
+      fprintf(stderr, "smallsh: wait: pid %s is not a child of this shell\n", argv[i]);
+    }
+  }
+  return result;
+}
+
+// builtin_times() - Print the user and system CPU time of the shell and of its reaped
+// children. In accounting mode, also list the most recent commands with what they cost;
+// -r clears that list.
+static int builtin_times(char* argv[]) {
+  if (argv[1] && strcmp(argv[1], "-r") == 0) {
+    num_acct = 0;
+    return 0;
+  }
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  struct timeval times[] = {self.ru_utime, self.ru_stime, children.ru_utime, children.ru_stime};
+  for (int i = 0; i < 4; i++) {
+    printf("%ldm%ld.%03lds%c", (long)times[i].tv_sec / 60, (long)times[i].tv_sec % 60,
+           (long)times[i].tv_usec / 1000, i % 2 ? '\n' : ' ');
+  }
+  if (acct_enabled && num_acct > 0) {
+    printf("%8s %6s %10s %10s %10s %9s %9s  %s\n", "pid", "status", "wall ms", "user ms",
+           "sys ms", "rss KiB", "spawn us", "command");
+    int first = num_acct > ACCT_HISTORY ? num_acct - ACCT_HISTORY : 0;
+    for (int i = first; i < num_acct; i++) {
+      const struct acct_record* record = &acct_history[i % ACCT_HISTORY];
+      printf("%8jd %6d %10.3f %10.3f %10.3f %9ld %9.1f  %s\n", (intmax_t)record->pid,
+             record->status, record->wall_ns / 1e6, ms(record->user), ms(record->sys),
+             record->max_rss, record->spawn_ns / 1e3, record->command);
+    }
+  }
+  fflush(stdout);
+  return 0;
+}
+
+// builtin_true() - Do nothing, successfully.
+static int builtin_true(char* argv[]) {
+  (void)argv;
+  return 0;
+}
+
+// builtin_false() - Do nothing, unsuccessfully.
+static int builtin_false(char* argv[]) {
+  (void)argv;
+  return 1;
+}
+
+// Where a backslash escape appears, which decides how octal and \x are read
+enum escape_mode {
+  ESCAPE_ECHO,     // echo -e: \0NNN or \NNN, and unknown escapes are left as they are
+  ESCAPE_FORMAT,   // The format of printf: \NNN
+  ESCAPE_ARGUMENT, // The argument of %b: \0NNN or \NNN
+};
+
+// put_escape() - Write the backslash escape that *p points just past to out, moving *p
+// over it. Returns 0 for \c, which stops all further output, and -1 for an escape that
+// printf leaves to the external command.
+static int put_escape(FILE* out, const char** p, enum escape_mode mode) {
+  static const char from[] = "abefnrtv\\\"";
+  static const char to[] = "\a\b\033\f\n\r\t\v\\\"";
+  char c = **p;
+  const char* known = c && !(c == '"' && mode == ESCAPE_ECHO) ? strchr(from, c) : NULL;
+  if (c == 'c') {
+    return 0;
+  } else if (known) {
+    putc(to[known - from], out);
+    (*p)++;
+  } else if (c >= '0' && c <= '7') {
+    // Up to three octal digits, after a 0 that only marks them outside the format
+    int value = 0;
+    if (c == '0' && mode != ESCAPE_FORMAT) {
+      (*p)++;
+    }
+    for (int i = 0; i < 3 && **p >= '0' && **p <= '7'; i++, (*p)++) {
+      value = value * 8 + (**p - '0');
+    }
+    putc(value, out);
+  } else if (c == 'x' && isxdigit((unsigned char)(*p)[1])) {
+    // One or two hex digits
+    int value = 0;
+    (*p)++;
+    for (int i = 0; i < 2 && isxdigit((unsigned char)**p); i++, (*p)++) {
+      value = value * 16 + (isdigit((unsigned char)**p) ? **p - '0' : tolower((unsigned char)**p) - 'a' + 10);
+    }
+    putc(value, out);
+  } else if (mode != ESCAPE_ECHO && (c == 'x' || c == 'u' || c == 'U')) {
+    return -1;
+  } else {
+    putc('\\', out);
+  }
+  return 1;
+}
+
+// put_escaped() - Write s to out, interpreting backslash escapes. Returns as put_escape().
+static int put_escaped(FILE* out, const char* s, enum escape_mode mode) {
+  for (const char* p = s; *p;) {
+    if (*p != '\\') {
+      putc(*p++, out);
+      continue;
+    }
+    p++;
+    int result = put_escape(out, &p, mode);
+    if (result != 1) {
+      return result;
+    }
+  }
+  return 1;
+}
+
+// builtin_echo() - Write the arguments separated by spaces. -n leaves out the newline,
+// -e interprets backslash escapes and -E does not.
+static int builtin_echo(char* argv[]) {
+  int newline = 1, escapes = 0;
+  int i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) {
+      break;
+    }
+    for (const char* flag = argv[i] + 1; *flag; flag++) {
+      newline &= *flag != 'n';
+      escapes = *flag == 'e' ? 1 : *flag == 'E' ? 0 : escapes;
+    }
+  }
+  for (int first = i; argv[i]; i++) {
+    if (i > first) {
+      putchar(' ');
+    }
+    if (!escapes) {
+      fputs(argv[i], stdout);
+    } else if (put_escaped(stdout, argv[i], ESCAPE_ECHO) == 0) {
+      return 0;
+    }
+  }
+  if (newline) {
+    putchar('\n');
+  }
+  return 0;
+}
+
+// printf_number_error() - Complain, as printf(1) does, about the argument value of a
+// numeric conversion that was not a number in full. Returns 1 if it did.
+static int printf_number_error(const char* value, const char* end) {
+  if (errno == ERANGE) {
+    fprintf(stderr, "smallsh: printf: %s: %s\n", value, strerror(ERANGE));
+  } else if (*end) {
+    fprintf(stderr, "smallsh: printf: %s: %s\n", value, end == value ? "expected a numeric value" : "value not completely converted");
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// printf_char_constant() - For an argument like 'c or "c, which stands for the code of
+// the character c, set *code and return 1.
+static int printf_char_constant(const char* value, unsigned char* code) {
+  if ((value[0] != '\'' && value[0] != '"') || value[1] == '\0') {
+    return 0;
+  }
+  *code = value[1];
+  if (value[2]) {
+    fprintf(stderr, "smallsh: printf: warning: %s: character(s) following character constant have been ignored\n", value + 2);
+  }
+  return 1;
+}
+
+// printf_format() - Write one pass over the format to out, taking arguments from *arg.
+// Returns 0 after \c, 1 to carry on, and -1 for something left to the external printf.
+static int printf_format(FILE* out, const char* format, char*** arg, int* status) {
+  for (const char* f = format; *f;) {
+    if (*f == '\\') {
+      f++;
+      int result = put_escape(out, &f, ESCAPE_FORMAT);
+      if (result != 1) {
+        return result;
+      }
+      continue;
+    }
+    if (*f != '%') {
+      putc(*f++, out);
+      continue;
+    }
+    if (f[1] == '%') {
+      putc('%', out);
+      f += 2;
+      continue;
+    }
+    // Copy the flags, width and precision, filling in a * from the arguments, and leave
+    // out any length modifier so one suited to the converted value can go in its place
+    char spec[64];
+    size_t len = 0;
+    spec[len++] = *f++;
+    for (int part = 0; part < 2; part++) {
+      if (part == 0) {
+        size_t flags = strspn(f, "-+ #0'");
+        if (flags > 8) {
+          return -1;
+        }
+        memcpy(spec + len, f, flags);
+        len += flags;
+        f += flags;
+      } else if (*f == '.') {
+        spec[len++] = *f++;
+      } else {
+        break;
+      }
+      if (*f == '*') {
+        const char* value = **arg ? *(*arg)++ : "";
+        char* end;
+        errno = 0;
+        long n = strtol(value, &end, 10);
+        *status |= printf_number_error(value, end);
+        if (part == 1 && n < 0) {
+          len--; // A negative precision is as if there were none
+        } else {
+          len += snprintf(spec + len, 16, "%d", (int)(n < -INT_MAX ? -INT_MAX : n > INT_MAX ? INT_MAX : n));
+        }
+        f++;
+      } else {
+        size_t digits = strspn(f, "0123456789");
+        if (digits > 10) {
+          return -1;
+        }
+        memcpy(spec + len, f, digits);
+        len += digits;
+        f += digits;
+      }
+    }
+    f += strspn(f, "hlLqjzt");
+    char conv = *f;
+    if (conv == '\0' || strchr("diouxXfFeEgGaAcsb", conv) == NULL) {
+      return -1;
+    }
+    f++;
+    const char* value = **arg ? *(*arg)++ : "";
+    char* end = (char*)value + strlen(value);
+    unsigned char code;
+    int is_char = printf_char_constant(value, &code);
+    errno = 0;
+    switch (conv) {
+      case 'd':
+      case 'i': {
+        long long n = is_char ? code : strtoll(value, &end, 0);
+        *status |= printf_number_error(value, end);
+        memcpy(spec + len, "lld", 4);
+        fprintf(out, spec, n);
+        break;
+      }
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X': {
+        unsigned long long n = is_char ? code : strtoull(value, &end, 0);
+        *status |= printf_number_error(value, end);
+        memcpy(spec + len, "ll", 2);
+        spec[len + 2] = conv;
+        spec[len + 3] = '\0';
+        fprintf(out, spec, n);
+        break;
+      }
+      case 'c':
+      case 's':
+        spec[len] = conv;
+        spec[len + 1] = '\0';
+        if (conv == 'c') {
+          fprintf(out, spec, value[0]);
+        } else {
+          fprintf(out, spec, value);
+        }
+        break;
+      case 'b': {
+        int result = put_escaped(out, value, ESCAPE_ARGUMENT);
+        if (result != 1) {
+          return result;
+        }
+        break;
+      }
+      default: {
+        long double n = is_char ? code : strtold(value, &end);
+        *status |= printf_number_error(value, end);
+        spec[len] = 'L';
+        spec[len + 1] = conv;
+        spec[len + 2] = '\0';
+        fprintf(out, spec, n);
+        break;
+      }
+    }
+  }
+  return 1;
+}
+
+// builtin_printf() - Write the arguments under the control of the format, which is
+// reused while arguments remain. Anything beyond the escapes and conversions of C, like
+// %q or \u, is left to the external printf, so the output is built in memory until the
+// whole of it is known to be the builtin's to write.
+static int builtin_printf(char* argv[]) {
+  if (argv[1] == NULL) {
+    fprintf(stderr, "smallsh: printf: missing operand\n");
+    return 1;
+  }
+  char* buf = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&buf, &size);
+  if (out == NULL) {
+    perror("smallsh: printf");
+    return 1;
+  }
+  int status = 0;
+  int result;
+  char** arg = argv + 2;
+  do {
+    char** start = arg;
+    result = printf_format(out, argv[1], &arg, &status);
+    if (result == 1 && arg == start && *arg) {
+      fprintf(stderr, "smallsh: printf: warning: ignoring excess arguments, starting with %s\n", *arg);
+      break;
+    }
+  } while (result == 1 && *arg);
+  fclose(out);
+  if (result == -1) {
+    free(buf);
+    return run_external(argv);
+  }
+  fwrite(buf, 1, size, stdout);
+  free(buf);
+  return status;
+}
+
+// test_unary() - Evaluate a unary test operator like -f FILE. Returns -1 for an unknown
+// operator.
+static int test_unary(const char* op, const char* arg) {
+  struct stat st;
+  if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+    return -1;
+  }
+  switch (op[1]) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 'p': return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 't': return isatty(atoi(arg));
+    default: return -1;
+  }
+}
+
+// test_binary() - Evaluate a binary test operator like A = B or N -lt M. Returns -1 for
+// an unknown operator and -2 for a bad number.
+static int test_binary(const char* a, const char* op, const char* b) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+    return strcmp(a, b) == 0;
+  } else if (strcmp(op, "!=") == 0) {
+    return strcmp(a, b) != 0;
+  }
+  static const char* const ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(op, ops[i]) != 0) {
+      continue;
+    }
+    char *end_a, *end_b;
+    long long x = strtoll(a, &end_a, 10), y = strtoll(b, &end_b, 10);
+    if (*a == '\0' || *end_a || *b == '\0' || *end_b) {
+      fprintf(stderr, "smallsh: test: %s: integer expression expected\n", *end_a || !*a ? a : b);
+      return -2;
+    }
+    int results[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+    return results[i];
+  }
+  return -1;
+}
+
+// test_expr() - Evaluate the test expression in argv[*i..n), with ! binding tightest,
+// then -a, then -o, and ( ) for grouping. Returns 1 for true, 0 for false and -2 after
+// reporting an error.
+static int test_expr(char* argv[], int* i, int n, int level) {
+  if (level < 2) {
+    int result = test_expr(argv, i, n, level + 1);
+    const char* op = level == 0 ? "-o" : "-a";
+    while (result >= 0 && *i < n && strcmp(argv[*i], op) == 0) {
+      (*i)++;
+      int rhs = test_expr(argv, i, n, level + 1);
+      result = rhs < 0 ? rhs : level == 0 ? result || rhs : result && rhs;
+    }
+    return result;
+  }
+  if (*i == n) {
+    fprintf(stderr, "smallsh: test: argument expected\n");
+    return -2;
+  }
+  if (strcmp(argv[*i], "!") == 0 && *i + 1 < n) {
+    (*i)++;
+    int result = test_expr(argv, i, n, 2);
+    return result < 0 ? result : !result;
+  }
+  if (strcmp(argv[*i], "(") == 0 && *i + 1 < n) {
+    (*i)++;
+    int result = test_expr(argv, i, n, 0);
+    if (result >= 0 && (*i == n || strcmp(argv[(*i)++], ")") != 0)) {
+      fprintf(stderr, "smallsh: test: `)' expected\n");
+      return -2;
+    }
+    return result;
+  }
+  if (*i + 3 <= n) {
+    int result = test_binary(argv[*i], argv[*i + 1], argv[*i + 2]);
+    if (result != -1) {
+      *i += 3;
+      return result;
+    }
+  }
+  if (*i + 2 <= n) {
+    int result = test_unary(argv[*i], argv[*i + 1]);
+    if (result != -1) {
+      *i += 2;
+      return result;
+    }
+  }
+  return argv[(*i)++][0] != '\0';
+}
+
+// builtin_test() - Evaluate a conditional expression, as test or as [ ... ]. Returns 0
+// if it is true, 1 if it is false and 2 on an error.
+static int builtin_test(char* argv[]) {
+  int n = 0;
+  while (argv[n]) {
+    n++;
+  }
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[n - 1], "]") != 0) {
+      fprintf(stderr, "smallsh: [: missing `]'\n");
+      return 2;
+    }
+    n--;
+  }
+  if (n == 1) {
+    return 1;
+  }
+  int i = 1;
+  int result = test_expr(argv, &i, n, 0);
+  if (result >= 0 && i < n) {
+    fprintf(stderr, "smallsh: test: %s: unexpected argument\n", argv[i]);
+    return 2;
+  }
+  return result < 0 ? 2 : !result;
+}
+
+// builtin_pwd() - Print the working directory.
+static int builtin_pwd(char* argv[]) {
+  (void)argv;
+  char* cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    perror("smallsh: pwd");
+    return 1;
+  }
+  puts(cwd);
+  free(cwd);
+  return 0;
+}
+
+// builtin_export() - Set each NAME=VALUE in the environment of the shell and the commands
+// it runs. A bare NAME is already exported if it is set. With no arguments, list the
+// environment.
+static int builtin_export(char* argv[]) {
+  if (argv[1] == NULL) {
+    for (char** env = environ; *env; env++) {
+      printf("export %s\n", *env);
+    }
+    return 0;
+  }
+  int status = 0;
+  for (int i = 1; argv[i]; i++) {
+    char* eq = strchr(argv[i], '=');
+    size_t name_len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+    int valid = name_len > 0 && !isdigit((unsigned char)argv[i][0]);
+    for (size_t j = 0; j < name_len && valid; j++) {
+      valid = isalnum((unsigned char)argv[i][j]) || argv[i][j] == '_';
+    }
+    if (!valid) {
+      fprintf(stderr, "smallsh: export: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (eq) {
+      *eq = '\0';
+      setenv(argv[i], eq + 1, 1);
+      *eq = '=';
+    }
+  }
+  return status;
+}
+
+static const struct builtin builtins[] = {
+  {"cd", builtin_cd},
+  {"exit", builtin_exit},
+  {"hash", builtin_hash},
+  {"parallel", builtin_parallel},
+  {"end", builtin_end},
+  {"wait", builtin_wait},
+  {"times", builtin_times},
+  {"true", builtin_true},
+  {"false", builtin_false},
+  {"echo", builtin_echo},
+  {"printf", builtin_printf},
+  {"test", builtin_test},
+  {"[", builtin_test},
+  {"pwd", builtin_pwd},
+  {"export", builtin_export},
+};
+
+// find_builtin() - Look up a builtin command by name, NULL if there is none.
+const struct builtin* find_builtin(const char* name) {
+  for (size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++) {
+    if (strcmp(builtins[i].name, name) == 0) {
+      return &builtins[i];
+    }
+  }
+  return NULL;
+}
+
+// syntax_error() - Report a syntax error, with its line while a script is being parsed.
+static void syntax_error(const char* token) {
+  if (script_line_number) {
+    fprintf(stderr, "smallsh: %s: line %d: syntax error near `%s'\n", script_name, script_line_number, token);
+  } else {
+    fprintf(stderr, "smallsh: syntax error near `%s'\n", token);
+  }
+}
+
+// parse_pipeline() - Split the words into the commands of a pipeline at each '|' and
+// pick out the '<', '>' and '>>' redirections of each command. The words array is
+// rearranged in place. Returns the number of commands, or -1 on a syntax error.
+int parse_pipeline(char* words[], int num_words, struct command cmds[]) {
+  int num_cmds = 0;
+  int w = 0;
+  struct command* cmd = &cmds[0];
+  memset(cmd, 0, sizeof *cmd);
+  cmd->argv = &words[0];
+  for (int i = 0; i < num_words; i++) {
+    char* word = words[i];
+    if (strcmp(word, "|") == 0) {
+      if (cmd->argv == &words[w] || num_cmds + 1 == MAX_PIPELINE) {
+        syntax_error("|");
+        return -1;
+      }
+      words[w++] = NULL;
+      cmd = &cmds[++num_cmds];
+      memset(cmd, 0, sizeof *cmd);
+      cmd->argv = &words[w];
+    } else if (strcmp(word, "<") == 0 || strcmp(word, ">") == 0 || strcmp(word, ">>") == 0) {
+      if (i + 1 == num_words) {
+        syntax_error(word);
+        return -1;
+      }
+      if (word[0] == '<') {
+        cmd->input_file = words[++i];
+      } else {
+        cmd->append = word[1] == '>';
+        cmd->output_file = words[++i];
+      }
+    } else {
+      words[w++] = word;
+    }
+  }
+  words[w] = NULL;
+  if (cmd->argv[0] == NULL) {
+    syntax_error("|");
+    return -1;
+  }
+  return num_cmds + 1;
+}
+
+// redirect() - Open the redirection files of a command in the child and make them its
+// standard in and out. They take precedence over the pipes.
+static void redirect(const struct command* cmd) {
+  if (cmd->input_file) {
+    int in_fd = open(cmd->input_file, O_RDONLY);
+    if (in_fd == -1) {
+      perror("smallsh");
+      exit(EXIT_FAILURE);
+    }
+    dup2(in_fd, STDIN_FILENO);
+    close(in_fd);
+  }
+  if (cmd->output_file) {
+    int flags = O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC);
+    int out_fd = open(cmd->output_file, flags, 0644);
+    if (out_fd == -1) {
+      perror("smallsh");
+      exit(EXIT_FAILURE);
+    }
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+  }
+}
+
+// redirect_builtin() - Apply the redirections of a builtin that runs in the shell, first
+// saving the standard in and out it replaces in saved. Returns -1 if a file could not be
+// opened; whatever was already replaced is still in saved.
+static int redirect_builtin(const struct command* cmd, int saved[2]) {
+  const char* files[2] = {cmd->input_file, cmd->output_file};
+  for (int fd = STDIN_FILENO; fd <= STDOUT_FILENO; fd++) {
+    if (files[fd] == NULL) {
+      continue;
+    }
+    int flags = fd == STDIN_FILENO ? O_RDONLY : O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC);
+    int file_fd = open(files[fd], flags | O_CLOEXEC, 0644);
+    if (file_fd == -1) {
+      fprintf(stderr, "smallsh: %s: %s\n", files[fd], strerror(errno));
+      return -1;
+    }
+    if (fd == STDOUT_FILENO) {
+      fflush(stdout);
+    }
+    saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    dup2(file_fd, fd);
+    close(file_fd);
+  }
+  return 0;
+}
+
+// restore_fds() - Put back the standard in and out saved by redirect_builtin().
+static void restore_fds(int saved[2]) {
+  for (int fd = STDIN_FILENO; fd <= STDOUT_FILENO; fd++) {
+    if (saved[fd] != -1) {
+      dup2(saved[fd], fd);
+      close(saved[fd]);
+    }
+  }
+}
+
+// spawn_command() - Start a command with posix_spawn, which does not copy the shell's
+// page tables the way fork does. The program comes from find_command() rather than a
+// PATH search on every launch, and a remembered path that no longer exists is forgotten
+// and searched for again. The redirection files are opened here so a failure names
+// the file, then the pipes and files become dup2 file actions. The signals the shell
+// handles or ignores go back to their defaults. Returns the pid, or -1 if the command
+// could not be started.
+static pid_t spawn_command(const struct command* cmd, int in_fd, int out_fd, pid_t pgid) {
+  int file_in = -1, file_out = -1;
+  if (cmd->input_file) {
+    file_in = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+    if (file_in == -1) {
+      fprintf(stderr, "smallsh: %s: %s\n", cmd->input_file, strerror(errno));
+      return -1;
+    }
+    in_fd = file_in;
+  }
+  if (cmd->output_file) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC);
+    file_out = open(cmd->output_file, flags, 0644);
+    if (file_out == -1) {
+      fprintf(stderr, "smallsh: %s: %s\n", cmd->output_file, strerror(errno));
+      if (file_in != -1) {
+        close(file_in);
+      }
+      return -1;
+    }
+    out_fd = file_out;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  posix_spawn_file_actions_init(&actions);
+  if (in_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  }
+  if (out_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  }
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, pgid);
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTSTP);
+  sigaddset(&signals, SIGCONT);
+  sigaddset(&signals, SIGTTOU);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  pid_t pid;
+  const char* file = find_command(cmd->argv[0]);
+  int err = file ? posix_spawn(&pid, file, &actions, &attr, cmd->argv, environ) : ENOENT;
+  if (err == ENOENT && file && file != cmd->argv[0]) {
+    hash_forget(cmd->argv[0]);
+    file = find_command(cmd->argv[0]);
+    err = file ? posix_spawn(&pid, file, &actions, &attr, cmd->argv, environ) : ENOENT;
+  }
+  if (err == ENOEXEC) {
+    // As execvp does, run an executable that is neither a binary nor a #! script with sh
+    char* sh_argv[MAX_WORDS + 2] = {"/bin/sh", (char*)file};
+    for (int i = 1; cmd->argv[i] && i <= MAX_WORDS; i++) {
+      sh_argv[i + 1] = cmd->argv[i];
+    }
+    err = posix_spawn(&pid, sh_argv[0], &actions, &attr, sh_argv, environ);
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (file_in != -1) {
+    close(file_in);
+  }
+  if (file_out != -1) {
+    close(file_out);
+  }
+  if (err != 0) {
+    fprintf(stderr, "smallsh: %s: %s\n", cmd->argv[0], strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+// fork_command() - Start a command in a forked child. Only needed for builtins that are
+// part of a pipeline or run in the background, which run in the child instead of the shell.
+static pid_t fork_command(const struct command* cmd, int in_fd, int out_fd, pid_t pgid) {
+  // Anything still buffered would otherwise be written by the child as well
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child process
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    events_forget();
+    setpgid(0, pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGCONT, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    if (in_fd != -1) {
+      dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+      dup2(out_fd, STDOUT_FILENO);
+    }
+    redirect(cmd);
+    exit(find_builtin(cmd->argv[0])->run(cmd->argv));
+  } else if (pid < 0) {
+    perror("fork failed");
+  }
+  return pid;
+}
+
+// run_external() - Run the command found on PATH under the name of a builtin and wait for
+// it, for what the builtin leaves to it. Returns its exit status.
+static int run_external(char* argv[]) {
+  struct command cmd = {.argv = argv};
+  fflush(stdout);
+  pid_t pid = spawn_command(&cmd, -1, -1, getpgrp());
+  int status;
+  if (pid == -1) {
+    return 127;
+  }
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+  }
+  return exit_status(status);
+}
+
+// pipe_size() - Size requested for the pipes between commands with the SMALLSH_PIPE_SIZE
+// environment variable, or 0 to leave the system default.
+static int pipe_size(void) {
+  char* size = getenv("SMALLSH_PIPE_SIZE");
+  return size ? atoi(size) : 0;
+}
+
+// execute_pipeline() - Run the commands with the standard out of each one connected to
+// the standard in of the next. All of them go in one process group, named after the
+// first, and are tracked as one job. A foreground pipeline gets the terminal and the
+// shell handles events until it is done or stopped; its exit status is that of the last
+// command. Returns the number of processes started.
+int execute_pipeline(struct command cmds[], int num_cmds, enum job_kind kind) {
+  struct job* job = malloc(sizeof *job + num_cmds * sizeof job->children[0]);
+  if (job == NULL) {
+    perror("smallsh");
+    return 0;
+  }
+  pid_t pgid = 0;
+  int in_fd = -1;
+  int size = pipe_size();
+  int launched = 0;
+  // In the jobs list from the start, so a switch away from pidfds sees its children
+  job->kind = kind;
+  job->status = 0;
+  job->last = -1;
+  job->remaining = 0;
+  job->num_children = 0;
+  link_job(job);
+  for (int i = 0; i < num_cmds; i++) {
+    int fds[2] = {-1, -1};
+    if (i + 1 < num_cmds) {
+      // Close on exec, so each command only keeps the ends it is given
+      if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("smallsh: pipe");
+        break;
+      }
+      if (size > 0 && fcntl(fds[1], F_SETPIPE_SZ, size) == -1) {
+        perror("smallsh: F_SETPIPE_SZ");
+      }
+    }
+    pid_t pid;
+    int64_t start_ns = acct_enabled ? now_ns() : 0;
+    if (find_builtin(cmds[i].argv[0])) {
+      pid = fork_command(&cmds[i], in_fd, fds[1], pgid);
+    } else {
+      pid = spawn_command(&cmds[i], in_fd, fds[1], pgid);
+    }
+    if (pid > 0) {
+      // Set the group here as well as in the child, so it is in place whichever runs first
+      if (pgid == 0) {
+        pgid = pid;
+      }
+      setpgid(pid, pgid);
+      if (pid == pgid && kind == JOB_FOREGROUND && is_interactive) {
+        // Before the rest start, so a first command reading the terminal is not stopped
+        tcsetpgrp(STDIN_FILENO, pgid);
+      }
+      if (i + 1 == num_cmds) {
+        job->last = launched;
+      }
+      job->children[launched].pid = pid;
+      job->children[launched].job = job;
+      if (acct_enabled) {
+        job->children[launched].start_ns = start_ns;
+        job->children[launched].spawn_ns = now_ns() - start_ns;
+        snprintf(job->children[launched].command, sizeof job->children[0].command, "%s", cmds[i].argv[0]);
+      }
+      job->num_children = job->remaining = ++launched;
+      watch_child(&job->children[launched - 1]);
+    } else if (i + 1 == num_cmds) {
+      job->status = 1;
+    }
+    if (in_fd != -1) {
+      close(in_fd);
+    }
+    if (fds[1] != -1) {
+      close(fds[1]);
+    }
+    in_fd = fds[0];
+  }
+  if (in_fd != -1) {
+    close(in_fd);
+  }
+  job->pgid = pgid;
+  if (launched == 0) {
+    unlink_job(job);
+    if (kind == JOB_FOREGROUND) {
+      last_exit_status = 1;
+    }
+    return 0;
+  }
+  if (kind != JOB_FOREGROUND) {
+    last_bg_pid = job->children[launched - 1].pid;
+    return launched;
+  }
+  foreground_job = job;
+  foreground_pid = job->children[launched - 1].pid;
+  foreground_pgid = pgid;
+  while (foreground_job) {
+    wait_events(-1);
+  }
+  if (is_interactive) {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  }
+  foreground_pid = -1;
+  foreground_pgid = -1;
+  return launched;
+}
+
+// bench_script() - Write a script to a temporary file and return its malloc'd path.
+static char* bench_script(const char* line, int count) {
+  const char* dir = getenv("TMPDIR");
+  char* path;
+  if (asprintf(&path, "%s/smallsh-bench-XXXXXX", dir ? dir : "/tmp") == -1) {
+    err(1, "asprintf");
+  }
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    err(1, "%s", path);
+  }
+  size_t len = strlen(line);
+  for (int i = 0; i < count; i++) {
+    if (write(fd, line, len) != (ssize_t)len) {
+      err(1, "%s", path);
+    }
+  }
+  close(fd);
+  return path;
+}
+
+// bench_run() - Run a program to completion with its output thrown away and return how
+// long that took in nanoseconds, or -1 if it could not be run.
+static int64_t bench_run(const char* file, char* argv[]) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  int64_t start = now_ns();
+  pid_t pid;
+  int status;
+  int failed = posix_spawn(&pid, file, &actions, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (failed) {
+    return -1;
+  }
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? now_ns() - start : -1;
+}
+
+// bench_shell() - Time a shell, this one or another, running the given script: the
+// fastest of runs tries.
+static int64_t bench_shell(const char* shell, const char* script, int runs) {
+  char* argv[] = {(char*)shell, (char*)script, NULL};
+  int64_t best = -1;
+  for (int i = 0; i < runs; i++) {
+    int64_t ns = bench_run(shell, argv);
+    if (ns < 0) {
+      return -1;
+    }
+    best = best < 0 || ns < best ? ns : best;
+  }
+  return best;
+}
+
+// bench_tokenize() - Split and expand a long line full of parameters over and over.
+// Returns the input throughput in MB/s and stores the words per second.
+static double bench_tokenize(double* words_per_sec) {
+  static const char word[] = "pre$$mid${HOME}post a\\ b $? ${BENCH_UNSET}x plain-word-here ";
+  char line[(MAX_WORDS / 6) * (sizeof word - 1) + 1];
+  char* words[MAX_WORDS + 1];
+  int num_words = 0;
+  size_t len = 0;
+  for (int i = 0; i < MAX_WORDS / 6; i++) {
+    memcpy(line + len, word, sizeof word - 1);
+    len += sizeof word - 1;
+  }
+  line[len] = '\0';
+  int iterations = 20000;
+  int64_t start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    arena_reset(&line_arena);
+    wordsplit(&line_arena, line, words, &num_words);
+    expand(&line_arena, words, num_words);
+  }
+  double secs = (now_ns() - start) / 1e9;
+  *words_per_sec = (double)num_words * iterations / secs;
+  return len * (double)iterations / secs / 1e6;
+}
+
+// bench_reap() - How long after a child exits the shell handles it. Each child sends the
+// time it is about to exit down a pipe, and the shell compares that with when its job
+// is done. Stores the worst case and returns the mean, in microseconds.
+static double bench_reap(int count, double* max_us) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    err(1, "pipe");
+  }
+  double total = 0;
+  *max_us = 0;
+  for (int i = 0; i < count; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      int64_t exit_ns = now_ns();
+      _exit(write(fds[1], &exit_ns, sizeof exit_ns) != sizeof exit_ns);
+    } else if (pid < 0) {
+      err(1, "fork");
+    }
+    struct job* job = calloc(1, sizeof *job + sizeof job->children[0]);
+    job->kind = JOB_PARALLEL;
+    job->remaining = job->num_children = 1;
+    job->children[0].pid = pid;
+    job->children[0].job = job;
+    link_job(job);
+    watch_child(&job->children[0]);
+    parallel_running++;
+    while (parallel_running > 0) {
+      wait_events(-1);
+    }
+    int64_t reaped_ns = now_ns();
+    int64_t exit_ns;
+    if (read(fds[0], &exit_ns, sizeof exit_ns) != sizeof exit_ns) {
+      err(1, "read");
+    }
+    double us = (reaped_ns - exit_ns) / 1e3;
+    total += us;
+    *max_us = us > *max_us ? us : *max_us;
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return total / count;
+}
+
+// run_bench() - Measure startup time, how many trivial commands a script runs per
+// second, tokenizer throughput and reaping latency, and print them as JSON. /bin/sh runs
+// the same scripts for comparison.
+int run_bench(int count) {
+  char self[4096];
+  ssize_t n = readlink("/proc/self/exe", self, sizeof self - 1);
+  if (n == -1) {
+    err(1, "/proc/self/exe");
+  }
+  self[n] = '\0';
+  char* empty = bench_script("", 0);
+  char* trues = bench_script("/bin/true\n", count);
+  int runs = 20;
+  int64_t startup = bench_shell(self, empty, runs);
+  int64_t sh_startup = bench_shell("/bin/sh", empty, runs);
+  int64_t script = bench_shell(self, trues, 3);
+  int64_t sh_script = bench_shell("/bin/sh", trues, 3);
+  unlink(empty);
+  unlink(trues);
+  free(empty);
+  free(trues);
+  double words_per_sec;
+  double tokenize = bench_tokenize(&words_per_sec);
+  double reap_max;
+  double reap = bench_reap(count < 1000 ? count : 1000, &reap_max);
+
+  printf("{\n");
+  printf("  \"commands\": %d,\n", count);
+  printf("  \"startup_us\": {\"smallsh\": %.1f, \"sh\": %.1f},\n", startup / 1e3, sh_startup / 1e3);
+  printf("  \"true_per_sec\": {\"smallsh\": %.1f, \"sh\": %.1f},\n",
+         script > 0 ? count / (script / 1e9) : -1, sh_script > 0 ? count / (sh_script / 1e9) : -1);
+  printf("  \"tokenize\": {\"mb_per_sec\": %.1f, \"words_per_sec\": %.0f},\n", tokenize, words_per_sec);
+  printf("  \"reap_latency_us\": {\"mean\": %.1f, \"max\": %.1f, \"method\": \"%s\"}\n", reap, reap_max,
+         use_pidfds ? "pidfd" : "sigchld");
+  printf("}\n");
   return 0;
 }
 
@@ -379,9 +2300,9 @@ void sigint_handler(int sig) {
       PS1 = "$ ";
     }
     fputs(PS1, stderr);
-    } else if (foreground_pid != -1) {
-      // If a foreground process is running, kill it
-      kill(foreground_pid, SIGINT);
+    } else if (foreground_pgid != -1) {
+      // If a foreground pipeline is running, kill it
+      kill(-foreground_pgid, SIGINT);
     }
   }
   void sigcont_handler(int sig) {